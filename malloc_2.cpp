@@ -2,23 +2,57 @@
 #include <iostream>
 #include <unistd.h>
 #include <cstring>
+#include <cassert>
+#include <stdint.h>
 
 #define ZERO_SIZE_MALLOC_REQ  0
 #define MAX_SIZE_MALLOC_REQ   100000000
 #define FAIL_SBRK_MALLOC_REQ  -1
 
+#define ALIGNMENT             8
+#define NUM_BINS              64
+#define BLOCK_OVERHEAD        (sizeof(MallocMetadata) + sizeof(size_t))    // Header plus boundary tag
+#define MIN_SPLIT_REMAINDER   128                 // Smallest tail payload worth splitting off
+
 
 
 //================ Struct related start ================
 struct MallocMetadata{
      size_t size;
      bool is_free;
-     MallocMetadata* next;
+     bool is_segment_start;        // No block right below us (first block of an sbrk run)
+     bool is_segment_end;          // No block right above us (last block of an sbrk run)
+     bool is_zero;                 // Payload is fresh sbrk memory nobody wrote yet
+     MallocMetadata* next;         // Bin links, only meaningful while the block is free
      MallocMetadata* prev;
 };
 
-MallocMetadata* heap_list = nullptr;
+struct Segment{                    // Sits in front of every sbrk run that does not continue the previous one
+     Segment* next;
+};
+
+MallocMetadata* bins[NUM_BINS]    = {nullptr};     // Free blocks only, bin i holds sizes in [2^i, 2^(i+1))
+uint64_t bins_map                 = 0;             // Bit i is set when bins[i] is not empty
+Segment* segment_list             = nullptr;
+MallocMetadata* heap_top          = nullptr;       // Highest block, the one sbrk can extend
+void* heap_end                    = nullptr;       // Program break right after heap_top
+
+struct MallocStats{                                // Everything _snapshot_stats() reports in one call
+     size_t free_blocks;
+     size_t free_bytes;
+     size_t allocated_blocks;
+     size_t allocated_bytes;
+     size_t meta_data_bytes;
+     size_t size_meta_data;
+};
+
+size_t free_blocks_counter      = 0;               // Kept up to date by the bin and block helpers
+size_t free_bytes_counter       = 0;
+size_t allocated_blocks_counter = 0;
+size_t allocated_bytes_counter  = 0;
 
+MallocMetadata* coalesce(MallocMetadata* block);
+void _snapshot_stats(MallocStats* stats);
 size_t _num_free_blocks();
 size_t _num_free_bytes();
 size_t _num_allocated_blocks();
@@ -27,37 +61,205 @@ size_t _num_meta_data_bytes();
 size_t _size_meta_data();
 //================= Struct related end =================
 
-//================= List related start =================
-void insert_block_to_heap_list(MallocMetadata* new_block){
-     if(!heap_list){               // Case we are only starting
-          heap_list = new_block;
-          new_block->next = nullptr;
-          new_block->prev = nullptr;
-          return;                  // Initiated and done
-     }
-     if(new_block < heap_list){    // Case new_block has smaller address than heap_list
-          new_block->next = heap_list;
-          new_block->prev = nullptr;
-          heap_list->prev = new_block;
-          heap_list = new_block;
+//================= Block related start ================
+size_t round_to_alignment(size_t size){
+     return (size + ALIGNMENT - 1) & ~((size_t)ALIGNMENT - 1);
+}
+
+size_t* footer_of(MallocMetadata* block){        // Boundary tag, a copy of size right after the payload
+     return (size_t*)((char*)(block + 1) + block -> size);
+}
+
+void write_footer(MallocMetadata* block){
+     *footer_of(block) = block -> size;
+}
+
+MallocMetadata* next_neighbor(MallocMetadata* block){
+     if(block -> is_segment_end){
+          return nullptr;
+     }
+     return (MallocMetadata*)(footer_of(block) + 1);
+}
+
+MallocMetadata* prev_neighbor(MallocMetadata* block){
+     if(block -> is_segment_start){
+          return nullptr;
+     }
+     size_t prev_size = *((size_t*)block - 1);     // The footer of the block below
+     return (MallocMetadata*)((char*)block - sizeof(size_t) - prev_size) - 1;
+}
+//================== Block related end =================
+
+//================== Bin related start =================
+int bin_of(size_t size){
+     return (int)(63 - __builtin_clzll(size));     // size is never 0, smalloc rounds up to ALIGNMENT
+}
+
+void insert_to_bin(MallocMetadata* block){
+     int bin          = bin_of(block -> size);
+     block -> is_free = true;
+     block -> prev    = nullptr;
+     block -> next    = bins[bin];
+     if(bins[bin]){
+          bins[bin] -> prev = block;
+     }
+     bins[bin]  = block;
+     bins_map  |= (1ULL << bin);
+     free_blocks_counter++;
+     free_bytes_counter += block -> size;
+}
+
+void remove_from_bin(MallocMetadata* block){
+     int bin = bin_of(block -> size);
+     if(block -> prev){
+          block -> prev -> next = block -> next;
+     }
+     else{
+          bins[bin] = block -> next;
+          if(!bins[bin]){
+               bins_map &= ~(1ULL << bin);
+          }
+     }
+     if(block -> next){
+          block -> next -> prev = block -> prev;
+     }
+     block -> is_free = false;
+     free_blocks_counter--;
+     free_bytes_counter -= block -> size;
+}
+
+MallocMetadata* find_fit(size_t size){
+     int bin = bin_of(size);
+     for(MallocMetadata* current = bins[bin]; current; current = current -> next){
+          if(current -> size >= size){             // Only our own bin can hold blocks that are too small
+               return current;
+          }
+     }
+     uint64_t larger = bins_map & ~((2ULL << bin) - 1);
+     if(!larger){
+          return nullptr;
+     }
+     return bins[__builtin_ctzll(larger)];          // Any block there is at least 2^(bin+1) > size
+}
+//=================== Bin related end ==================
+
+//============ Split and coalesce related start ========
+void split_block(MallocMetadata* block, size_t size){      // block is in use, the tail goes to a bin
+     if(block -> size < size + BLOCK_OVERHEAD + MIN_SPLIT_REMAINDER){
           return;
      }
-     MallocMetadata* current_list = heap_list;
-     while(current_list->next && (current_list->next < new_block)){
-          current_list = current_list->next;      // Find the last block
+     MallocMetadata* remainder     = (MallocMetadata*)((char*)(block + 1) + size + sizeof(size_t));
+     remainder -> size             = block -> size - size - BLOCK_OVERHEAD;
+     remainder -> is_segment_start = false;
+     remainder -> is_segment_end   = block -> is_segment_end;
+     remainder -> is_zero          = block -> is_zero;
+     block -> size                 = size;
+     block -> is_segment_end       = false;
+     write_footer(block);
+     write_footer(remainder);
+     if(heap_top == block){
+          heap_top = remainder;
      }
-     new_block->next = current_list->next;        // Add the new block in the currect place
-     new_block->prev = current_list;
+     allocated_blocks_counter++;
+     allocated_bytes_counter      -= BLOCK_OVERHEAD;
+     insert_to_bin(coalesce(remainder));
+}
 
-     if(current_list->next){                      
-          (current_list->next)->prev = new_block;
+void absorb_next(MallocMetadata* block){         // Glue the next neighbor (already out of its bin) onto block
+     MallocMetadata* next     = next_neighbor(block);
+     block -> size           += BLOCK_OVERHEAD + next -> size;
+     block -> is_segment_end  = next -> is_segment_end;
+     block -> is_zero         = false;            // The old header and footer are inside now
+     write_footer(block);
+     if(heap_top == next){
+          heap_top = block;
      }
-     current_list->next = new_block;
-     return;
+     allocated_blocks_counter--;
+     allocated_bytes_counter += BLOCK_OVERHEAD;
+}
+
+MallocMetadata* coalesce(MallocMetadata* block){ // block is not in a bin, returns the merged block
+     MallocMetadata* next = next_neighbor(block);
+     if(next && next -> is_free){
+          remove_from_bin(next);
+          absorb_next(block);
+     }
+     MallocMetadata* prev = prev_neighbor(block);
+     if(prev && prev -> is_free){
+          remove_from_bin(prev);
+          absorb_next(prev);
+          block = prev;
+     }
+     return block;
+}
+//============= Split and coalesce related end =========
+
+//=================== Sbrk related start ===============
+MallocMetadata* extend_heap(size_t size){
+     void* program_break = sbrk(0);
+     if(heap_top && program_break == heap_end && heap_top -> is_free){
+          size_t missing = size - heap_top -> size;          // Only grow the free top block by what it lacks
+          if(sbrk(missing) == (void*)FAIL_SBRK_MALLOC_REQ){
+               return nullptr;
+          }
+          MallocMetadata* block = heap_top;
+          remove_from_bin(block);
+          block -> size           += missing;
+          block -> is_zero         = false;
+          write_footer(block);
+          allocated_bytes_counter += missing;
+          heap_end                 = (char*)heap_end + missing;
+          return block;
+     }
+
+     bool contiguous = heap_top && program_break == heap_end;
+     size_t request  = BLOCK_OVERHEAD + size + (contiguous ? 0 : sizeof(Segment));
+     void* new_start = sbrk(request);
+     if(new_start == (void*)FAIL_SBRK_MALLOC_REQ){
+          return nullptr;                         // Bullet c. (sbrk failed)
+     }
+
+     MallocMetadata* block;
+     if(contiguous){
+          heap_top -> is_segment_end = false;
+          block                      = (MallocMetadata*)new_start;
+          block -> is_segment_start  = false;
+     }
+     else{                                        // Someone else moved the break, start a new segment
+          Segment* segment = (Segment*)new_start;
+          segment -> next  = segment_list;
+          segment_list     = segment;
+          block                      = (MallocMetadata*)(segment + 1);
+          block -> is_segment_start  = true;
+     }
+     block -> size            = size;
+     block -> is_free         = false;
+     block -> is_segment_end  = true;
+     block -> is_zero         = true;
+     block -> next            = nullptr;
+     block -> prev            = nullptr;
+     write_footer(block);
+
+     heap_top  = block;
+     heap_end  = (char*)new_start + request;
+     allocated_blocks_counter++;
+     allocated_bytes_counter += size;
+     return block;
 }
-//================== List related end ==================
+//==================== Sbrk related end ================
 
 //=========== malloc_2 implemintations start ===========
+MallocMetadata* allocate_block(size_t size){     // is_zero still tells whether the payload is clean
+     size = round_to_alignment(size);
+     MallocMetadata* block = find_fit(size);
+     if(block){
+          remove_from_bin(block);
+          split_block(block, size);               // Give the unused tail back
+          return block;
+     }
+     return extend_heap(size);                    // If here, no bin could serve us, grow the heap
+}
+
 void* smalloc(size_t size){
 
      if(size == ZERO_SIZE_MALLOC_REQ){            // Bullet a. (size is 0), TODO what if size<0?
@@ -67,30 +269,12 @@ void* smalloc(size_t size){
           return NULL;
      }
 
-     MallocMetadata* current_list       = heap_list;
-     while(current_list){
-          if(current_list->is_free && current_list->size >= size){         // If found big enough slot for our block
-               current_list->is_free    = false;
-               return (void*)(current_list + 1);                           // 1 for the Metadata
-          }
-          current_list = current_list->next;
-     }
-
-     void* new_block_start = sbrk(_size_meta_data() + size);               // If here, we didnt find place in list, alloc new
-     if(new_block_start == (void*)FAIL_SBRK_MALLOC_REQ){
-          return NULL;                            // Bullet c. (size is bigger than 10^8)
+     MallocMetadata* block = allocate_block(size);
+     if(!block){
+          return NULL;
      }
-
-     MallocMetadata* new_block_Metadata = (MallocMetadata*)new_block_start;
-     new_block_Metadata -> size         = size;
-     new_block_Metadata ->is_free       = false;
-     new_block_Metadata -> next         = nullptr;     // Will be handeled in list manager
-     new_block_Metadata -> prev         = nullptr;
-
-     insert_block_to_heap_list(new_block_Metadata);
-
-     return (void*)(new_block_Metadata + 1); 
-     
+     block -> is_zero = false;                    // The caller will write it
+     return (void*)(block + 1);                   // 1 for the Metadata
 }
 
 void* scalloc(size_t num, size_t size){
@@ -98,18 +282,20 @@ void* scalloc(size_t num, size_t size){
      if(num == ZERO_SIZE_MALLOC_REQ || size == ZERO_SIZE_MALLOC_REQ){           // Bullet a. (size is 0), TODO what if size<0?
           return NULL;
      }
-     size_t total_size = num*size;
-     if((total_size) > MAX_SIZE_MALLOC_REQ){                                    // Bullet b. (size is bigger than 10^8)
+     if(num > MAX_SIZE_MALLOC_REQ / size){                                      // Bullet b. (size is bigger than 10^8), no num*size overflow
           return NULL;
      }
+     size_t total_size = num*size;
 
-     void* new_block = smalloc(total_size);
-     if(!new_block){
+     MallocMetadata* block = allocate_block(total_size);
+     if(!block){
           return NULL;
      }
-
-     std::memset(new_block, 0, total_size);
-     return new_block;
+     if(!block -> is_zero){                                                     // Fresh sbrk memory is already zero
+          std::memset((void*)(block + 1), 0, total_size);
+     }
+     block -> is_zero = false;
+     return (void*)(block + 1);
 }
 
 void sfree(void* p){
@@ -121,7 +307,8 @@ void sfree(void* p){
      if(block_Metadata -> is_free) {
           return;
      }
-     block_Metadata -> is_free = true;
+     block_Metadata -> is_zero = false;
+     insert_to_bin(coalesce(block_Metadata));      // Neighbors are found through the boundary tags
      return;
 }
 
@@ -137,8 +324,18 @@ void* srealloc(void* oldp, size_t size){
           return smalloc(size);                   // Bullet Succes.b. smalloc equivalant
      }
      MallocMetadata* block_Metadata = (((MallocMetadata*)oldp) - 1);
+     size = round_to_alignment(size);
      if(block_Metadata->size >= size){
-          return oldp;                            // First bullet
+          split_block(block_Metadata, size);      // First bullet, trimming the tail if it is worth it
+          return oldp;
+     }
+
+     MallocMetadata* next = next_neighbor(block_Metadata);
+     if(next && next -> is_free && block_Metadata -> size + BLOCK_OVERHEAD + next -> size >= size){
+          remove_from_bin(next);                  // Grow in place over the free neighbor above
+          absorb_next(block_Metadata);
+          split_block(block_Metadata, size);
+          return oldp;
      }
 
      void* new_block = smalloc(size);             // If here we need a new memory allocation
@@ -155,49 +352,73 @@ void* srealloc(void* oldp, size_t size){
 //============ malloc_2 implemintations end ============
 
 
-size_t _num_free_blocks(){
-     size_t free_blocks_count      = 0;
-     MallocMetadata* current_p     = heap_list;
-     while(current_p){
-          if(current_p -> is_free){
-               free_blocks_count++;
+#ifdef MALLOC_DEBUG
+size_t walk_blocks(bool only_free, bool count_bytes){      // Physical walk of every segment
+     size_t count = 0;
+     for(Segment* segment = segment_list; segment; segment = segment->next){
+          MallocMetadata* current_p = (MallocMetadata*)(segment + 1);
+          while(current_p){
+               assert(*footer_of(current_p) == current_p->size);
+               if(!only_free || current_p->is_free){
+                    count += count_bytes ? current_p->size : 1;
+               }
+               current_p = next_neighbor(current_p);
           }
-          current_p = current_p->next;
      }
-     return free_blocks_count;
+     return count;
+}
+size_t walk_free_blocks(){
+     return walk_blocks(true, false);
+}
+size_t walk_free_bytes(){
+     return walk_blocks(true, true);
+}
+size_t walk_allocated_blocks(){
+     return walk_blocks(false, false);
+}
+size_t walk_allocated_bytes(){
+     return walk_blocks(false, true);
+}
+#endif
+
+void _snapshot_stats(MallocStats* stats){
+     stats -> free_blocks          = free_blocks_counter;
+     stats -> free_bytes           = free_bytes_counter;
+     stats -> allocated_blocks     = allocated_blocks_counter;
+     stats -> allocated_bytes      = allocated_bytes_counter;
+     stats -> meta_data_bytes      = allocated_blocks_counter * _size_meta_data();
+     stats -> size_meta_data       = _size_meta_data();
+#ifdef MALLOC_DEBUG
+     assert(stats->free_blocks      == walk_free_blocks());       // The walkers stay as the reference
+     assert(stats->free_bytes       == walk_free_bytes());
+     assert(stats->allocated_blocks == walk_allocated_blocks());
+     assert(stats->allocated_bytes  == walk_allocated_bytes());
+#endif
+}
+
+size_t _num_free_blocks(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.free_blocks;
 }
 size_t _num_free_bytes(){
-     size_t free_bytes_count       = 0;
-     MallocMetadata* current_p     = heap_list;
-     while(current_p){
-          if(current_p -> is_free){
-               free_bytes_count += current_p->size;
-          }
-          current_p = current_p->next;
-     }
-     return free_bytes_count;
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.free_bytes;
 }
 size_t _num_allocated_blocks(){
-     size_t alloced_blocks_count   = 0;
-     MallocMetadata* current_p     = heap_list;
-     while(current_p){
-          alloced_blocks_count++;
-          current_p = current_p->next;
-     }
-     return alloced_blocks_count;
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.allocated_blocks;
 }
 size_t _num_allocated_bytes(){
-     size_t alloced_bytes_count    = 0;
-     MallocMetadata* current_p     = heap_list;
-     while(current_p){
-          alloced_bytes_count += current_p->size;
-          current_p = current_p->next;
-     }
-     return alloced_bytes_count;
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.allocated_bytes;
 }
 size_t _num_meta_data_bytes(){
      return _num_allocated_blocks() * _size_meta_data();
 }
 size_t _size_meta_data(){
-     return sizeof(MallocMetadata);
+     return BLOCK_OVERHEAD;
 }
@@ -3,33 +3,266 @@
 #include <unistd.h>
 #include <cstring>
 #include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <time.h>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/auxv.h>
+#include <cmath>
+#include <cstdarg>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <signal.h>
+#include <semaphore.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define ZERO_SIZE_MALLOC_REQ  0
-#define MAX_SIZE_MALLOC_REQ   100000000
+#ifndef MAX_SIZE_MALLOC_REQ
+#define MAX_SIZE_MALLOC_REQ   100000000                // The interposed build may raise it, real programs ask for more
+#endif
 #define FAIL_SBRK_MALLOC_REQ  -1
 
+#ifndef MAX_ORDER                                      // Geometry of the default heap, see BuddyHeap for other instances
 #define MAX_ORDER             10
-#define TOTAL_BLOCKS          32
+#endif
+#ifndef TOTAL_BLOCKS
+#define TOTAL_BLOCKS          32                       // MAX_ORDER blocks per arena
+#endif
+#ifndef ZERO_ORDER_BLOCK_SIZE
 #define ZERO_ORDER_BLOCK_SIZE 128
-#define INITIAL_BLOCK_SIZE    (1 << MAX_ORDER) * ZERO_ORDER_BLOCK_SIZE
-#define INITIAL_HEAP_SIZE     INITIAL_BLOCK_SIZE * TOTAL_BLOCKS
-#define SIZE_FOR_MMAP         (1 << MAX_ORDER) * ZERO_ORDER_BLOCK_SIZE
+#endif
+
+#ifndef MAX_ARENAS
+#define MAX_ARENAS            64                       // Arena slots of a buddy heap, unless its type says otherwise
+#endif
+#ifndef ARENA_FREE_HIGH_WATER
+#define ARENA_FREE_HIGH_WATER 1                        // Fully free arenas kept before the rest go back to the OS
+#endif
+
+#define BITS_PER_WORD         64
+
+#ifndef DEFERRED_COALESCE
+#define DEFERRED_COALESCE     0                        // 1 parks freed buddy blocks on per-order quick lists and merges them in batches
+#endif
+#ifndef QUICK_LIST_LIMIT
+#define QUICK_LIST_LIMIT      32                       // Blocks per order and arena before that quick list is merged
+#endif
+
+#ifndef THREAD_CACHE
+#define THREAD_CACHE          0                        // 1 puts per-thread magazines in front of the buddy heap
+#endif
+#define THREAD_CACHE_MAX_ORDER 3                       // Orders 0..3 are cached per thread
+#define THREAD_CACHE_CAPACITY  32                      // Blocks per order in one magazine
+#define THREAD_CACHE_BATCH     16                      // Blocks moved per refill / flush
+#define THREAD_CACHE_MAX_SIZE  ((ZERO_ORDER_BLOCK_SIZE << THREAD_CACHE_MAX_ORDER) - sizeof(MallocMetadata))   // Biggest payload served from a magazine
+
+#ifdef MALLOC_INTERPOSE
+#define SLAB_CLASSES          5                        // libc callers expect 16-byte alignment even for malloc(8)
+#define SLAB_MIN_SIZE         16
+#else
+#define SLAB_CLASSES          6
+#define SLAB_MIN_SIZE         8                        // Only 8-byte aligned
+#endif
+#define SLAB_MAX_SIZE         96                       // Requests up to here are served by the slab layer
+#define SLAB_MAX_ORDER        3                        // Slabs are carved from order 0..3 buddy blocks
+#define SLAB_OBJECT_ALIGNMENT 16                       // SSE / long double safe for every class from 16 bytes up
+
+#define MMAP_CACHE_BUCKETS    32
+#ifndef MMAP_CACHE_BUDGET
+#define MMAP_CACHE_BUDGET     (64 << 20)               // Bytes of freed mappings kept for reuse
+#endif
+#ifndef MMAP_CACHE_DECAY_MS
+#define MMAP_CACHE_DECAY_MS   1000                     // Cached mappings older than this are unmapped
+#endif
+#ifdef MALLOC_INTERPOSE
+#ifndef MALLOC_INTERPOSE_ALIGNMENT
+#define MALLOC_INTERPOSE_ALIGNMENT 16                  // What callers of the libc malloc expect (alignof(max_align_t))
+#endif
+#define MALLOC_INTERPOSE_BOOTSTRAP 4096                // Serves allocations made from inside initial_allocator
+#define FAST_PAYLOAD_OFFSET   MALLOC_INTERPOSE_ALIGNMENT   // malloc's buddy payloads sit past an alias header, see smalloc_fast_aligned
+#else
+#define FAST_PAYLOAD_OFFSET   sizeof(MallocMetadata)   // Where sfree_fast expects a payload in a ZERO_ORDER_BLOCK_SIZE line, no slab object starts there
+#endif
+
+#ifndef PURGE_THRESHOLD
+#define PURGE_THRESHOLD       (16 << 20)               // Dirty free buddy bytes that trigger a purge, 0 leaves it to strim()
+#endif
+#define PURGE_MIN_BLOCK       (8 << 10)                // Smaller free blocks have no page past the header to give back
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE          MADV_DONTNEED
+#endif
+
+#ifndef HUGE_PAGE_ARENAS
+#define HUGE_PAGE_ARENAS      0                        // 1 backs arenas with THP (MADV_HUGEPAGE), 2 tries MAP_HUGETLB first
+#endif
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE        (2 << 20)
+#endif
+
+#ifndef NUMA_ARENAS
+#define NUMA_ARENAS           0                        // 1 gives every NUMA node its own arenas, 2 interleaves arena pages over all nodes
+#endif
+#ifndef NUMA_SIMULATED_NODES
+#define NUMA_SIMULATED_NODES  0                        // Pretend to have this many nodes (cpu % nodes), to try NUMA_ARENAS on one node
+#endif
+#define NUMA_MAX_NODES        8                        // Nodes past this share the last one's arenas
+#ifndef MPOL_PREFERRED                                 // From <numaif.h>, which comes with libnuma and is not needed otherwise
+#define MPOL_PREFERRED        1
+#define MPOL_INTERLEAVE       3
+#endif
+
+#ifndef PERSISTENT_MAX_ORDER
+#define PERSISTENT_MAX_ORDER  14                       // File backed heaps (sheap_open) have 2 MiB top blocks
+#endif
+#ifndef PERSISTENT_TOTAL_BLOCKS
+#define PERSISTENT_TOTAL_BLOCKS 512                    // and a 1 GiB region, the file is sparse
+#endif
+#define PERSISTENT_MAGIC      0x3370616568336d73ULL
+#define PERSISTENT_VERSION    1
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE   0x100000                 // Linux 4.17, older headers lack it
+#endif
+
+#ifdef MALLOC_HARDENED                                 // Sealed headers, every pointer handed back is validated before use
+#define HEADER_SIZE_BITS      44                       // 16 TiB is plenty, the bits go to the header check
+#define HEADER_CHECK_BITS     8
+#else
+#define HEADER_SIZE_BITS      52
+#endif
+#define HEADER_CHECKED_BITS   (((uint64_t)1 << (HEADER_SIZE_BITS + 9)) - 1)   // size, order, is_free, is_mmap and is_aligned
+
+#ifndef NT_ZERO_THRESHOLD
+#define NT_ZERO_THRESHOLD     (1 << 20)                // scalloc zeroes blocks this big with streaming stores, smaller ones are hot in cache
+#endif
+
+#ifndef MMAP_CACHE_ADVICE
+#define MMAP_CACHE_ADVICE     MADV_DONTNEED            // Drops the cached pages from RSS, MADV_FREE is lazier
+#endif
+
+#ifndef MALLOC_PROFILE
+#define MALLOC_PROFILE        0                        // 1 samples allocations with their call stacks, see sprofile_dump()
+#endif
+#ifndef PROFILE_SAMPLE_BYTES
+#define PROFILE_SAMPLE_BYTES  (512 << 10)              // Mean bytes allocated between two samples
+#endif
+#define PROFILE_MAX_DEPTH     32                       // Frames kept per sample
+#define PROFILE_MAX_SITES     1024                     // Distinct stacks, samples from further ones are dropped
+#define PROFILE_LIVE_BITS     12                       // Up to 2^12 sampled allocations live at once
+#define PROFILE_LIFETIMES     5                        // Freed within 10us, 1ms, 100ms, later, or still live
+#define PROFILE_ORDER_MMAP    -1
+#define PROFILE_ORDER_SLAB    -2
+#define PROFILE_DUMP_COLLAPSED 0                       // "frame;frame;[order 3];[<1ms] bytes" lines for flamegraph.pl
+#define PROFILE_DUMP_PPROF     1                       // Legacy heap_v2 text profile for pprof
+#ifndef MALLOC_TELEMETRY
+#define MALLOC_TELEMETRY      0                        // 1 times sampled smalloc / sfree calls for stelemetry_dump()
+#endif
+#ifndef TELEMETRY_SAMPLE_EVERY
+#define TELEMETRY_SAMPLE_EVERY 64                      // Calls per thread between two timed ones
+#endif
+#define TELEMETRY_BUCKETS     32
+#define TELEMETRY_PATH_MAX    256
 
 //================ Struct related start ================
-struct MallocMetadata{
-     size_t              size;
-     bool                is_free;
-     bool                is_mmap;
-     int                 order;
-     MallocMetadata*     next;
-     MallocMetadata*     prev;
+struct MallocMetadata{                                          // One packed word right before every payload
+     uint64_t            size      : HEADER_SIZE_BITS;          // Whole block including this header, or the alias distance
+     int64_t             order     : 6;                         // -1 for mmap blocks
+     uint64_t            is_free   : 1;
+     uint64_t            is_mmap   : 1;
+     uint64_t            is_aligned: 1;                         // Alias in front of an aligned payload, size leads back to the block
+     uint64_t            is_zero   : 1;                         // Payload never written, except the FreeBlock links
+     uint64_t            is_purged : 1;                         // Free block whose pages past the header page went back to the OS
+     uint64_t            is_sampled: 1;                         // Live block in the profiler's sample table, stale on free blocks
+#ifdef MALLOC_HARDENED
+     uint64_t            check     : HEADER_CHECK_BITS;         // Keyed hash of the fields above and the header address
+#endif
+};
+static_assert(sizeof(MallocMetadata) == 8, "MallocMetadata must stay one word");
+
+template<typename T>
+struct OffsetPtr{                                               // Self relative link, stays valid when the whole region moves
+     int64_t             delta;                                 // 0 is nullptr, a link never points at itself
+
+     OffsetPtr() = default;
+     OffsetPtr(const OffsetPtr&) = delete;                      // A copied delta would point somewhere else
+     OffsetPtr& operator=(T* p){
+          delta = p ? (char*)p - (char*)this : 0;
+          return *this;
+     }
+     OffsetPtr& operator=(const OffsetPtr& other){
+          return *this = (T*)other;
+     }
+     operator T*() const{
+          return delta ? (T*)((char*)this + delta) : nullptr;
+     }
+     T* operator->() const{
+          return *this;
+     }
+};
+
+template<typename T> using RawPtr = T*;
+
+template<template<typename> class Ptr>
+struct BasicFreeBlock{                                          // Free buddy blocks keep their links in the payload
+     MallocMetadata      header;
+     Ptr<BasicFreeBlock> next;
+     Ptr<BasicFreeBlock> prev;
+};
+typedef BasicFreeBlock<RawPtr> FreeBlock;
+
+struct MmapBlock{                                               // mmap blocks keep their mmap_list links ahead of the header
+     MmapBlock*          next;
+     MmapBlock*          prev;
+     size_t              length;                                // Page rounded length of the whole mapping
+     MallocMetadata      header;
 };
 
-MallocMetadata* free_list[MAX_ORDER + 1] = {nullptr};       // Array of lists for every order
-MallocMetadata* mmap_list                = nullptr;         // mmap_list as suggested
+MmapBlock* mmap_list                     = nullptr;         // mmap_list as suggested
+
+size_t page_size                         = 0;
+uint64_t header_secret                   = 0;               // Keys the header checks, random per process
 
-void* base_address = nullptr;
+pthread_mutex_t heap_lock                = PTHREAD_MUTEX_INITIALIZER;       // Guards the arenas and mmap_list
+pthread_mutex_t profile_lock             = PTHREAD_MUTEX_INITIALIZER;       // Guards the profiler tables, never taken under heap_lock
+pthread_once_t heap_once                 = PTHREAD_ONCE_INIT;
+thread_local bool in_initial_allocator __attribute__((tls_model("initial-exec"))) = false;  // Set while this thread runs initial_allocator
+pthread_key_t thread_cache_key;                                             // Its destructor flushes a thread cache when the thread exits
 
+struct MallocStats{                                             // Everything _snapshot_stats() reads under one lock
+     size_t              free_blocks;
+     size_t              free_bytes;
+     size_t              allocated_blocks;
+     size_t              allocated_bytes;
+     size_t              meta_data_bytes;
+     size_t              size_meta_data;
+     size_t              mmap_blocks;
+     size_t              mmap_bytes;
+     size_t              dirty_bytes;
+     size_t              purged_bytes;
+     size_t              quick_blocks;                          // Free buddy blocks still waiting to be merged (DEFERRED_COALESCE)
+     size_t              arenas;
+     size_t              splits;                                // Buddy blocks halved, since the start
+     size_t              merges;                                // Buddy pairs joined, since the start
+     size_t              free_per_order[MAX_ORDER + 1];         // Buddy blocks on the free lists and quick lists
+     size_t              used_per_order[MAX_ORDER + 1];         // Buddy blocks handed out (slabs and thread caches included)
+};
+
+size_t mmap_blocks                       = 0;               // Counters behind the stats, guarded by heap_lock
+size_t mmap_bytes                        = 0;
+
+void _snapshot_stats(MallocStats* stats);
 size_t _num_free_blocks();
 size_t _num_free_bytes();
 size_t _num_allocated_blocks();
@@ -38,377 +271,3253 @@ size_t _num_meta_data_bytes();
 size_t _size_meta_data();
 //================= Struct related end =================
 
-//================ Helper related start ================
-void initial_allocator();
-
-int get_order_from_size(size_t request_size);
-void insert_to_free_list(MallocMetadata* block, int order);
-void remove_from_free_list(MallocMetadata* block, int order);
-
-void initial_allocator(){
+//================= NUMA related start =================
+int numa_nodes                           = 1;               // Real nodes, or NUMA_SIMULATED_NODES, set once in initial_allocator
+int numa_real_nodes                      = 1;
+thread_local int numa_thread_node __attribute__((tls_model("initial-exec"))) = -1;   // Set by snuma_bind_thread(), -1 follows the CPU
 
-     void* curr = sbrk(0);                                                      // Your alligment trick
-     char* curr_ptr = (char*)curr;
-     size_t align_size = INITIAL_HEAP_SIZE;
-     size_t offset = (size_t)curr_ptr % align_size;
-     size_t padding = (offset == 0) ? 0 : (align_size-offset);
-     
-     void* raw = sbrk(padding + INITIAL_HEAP_SIZE);
-     if( raw == (void*)FAIL_SBRK_MALLOC_REQ ){
-          perror("sbrk failed in the initial_allocator");                       // Some error handling
-          exit(1);
-     }
-
-     base_address = (char*)raw + padding;                                       // Initial size for 32 free blocks, each is 10 order
-
-     for(int i=0 ; i<TOTAL_BLOCKS ; ++i){
-          MallocMetadata* block    = (MallocMetadata*)((char*)base_address + (i * INITIAL_BLOCK_SIZE));
-          block -> size            = INITIAL_BLOCK_SIZE;
-          block -> is_free         = true;
-          block -> is_mmap         = false;
-          block -> order           = MAX_ORDER;
-          block -> next            = nullptr;
-          block -> prev            = nullptr;
-          insert_to_free_list(block, block -> order);
-     }
-}
-
-int get_order_from_size(size_t request_size){
-     size_t actual_requested_size = request_size + sizeof(MallocMetadata);      // The true size we need calculates the metadata
-     size_t block_size = ZERO_ORDER_BLOCK_SIZE;                                 // Trying to fit the minimal size first
-     int result_order = 0;
-     while( (result_order <= MAX_ORDER) && (block_size < actual_requested_size) ){
-          block_size <<=1;                                                      // **2
-          result_order++;
-     }
-     return ( (result_order > MAX_ORDER) ? -1 : result_order );
-}
-
-void insert_to_free_list(MallocMetadata* block, int order){
-     block -> next                 = nullptr;
-     block -> prev                 = nullptr;
-     
-     if(!free_list[order]){                                                     // If first block in free_list
-          free_list[order] = block;
-          return;
+int numa_detect_nodes(){                          // Highest node in /sys/devices/system/node/online, plus one
+     char text[64];
+     int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+     ssize_t length = (fd >= 0) ? read(fd, text, sizeof(text) - 1) : -1;
+     if( fd >= 0 ){
+          close(fd);
      }
-
-     MallocMetadata* current_list = free_list[order];
-     if(block < current_list){                                                  // If block has smaller address than the smallest in the list
-          block -> next            = current_list;
-          current_list -> prev     = block;
-          free_list[order]         = block;
-          return;
+     int highest = 0;
+     for(ssize_t i=0 ; i<length ; ){                                           // "0", "0-1" or "0,2-3", no strtol before the heap is up
+          int node = 0;
+          while( i < length && text[i] >= '0' && text[i] <= '9' ){
+               node = node * 10 + (text[i++] - '0');
+          }
+          highest = std::max(highest, node);
+          i++;
      }
+     return std::min(highest + 1, NUMA_MAX_NODES);
+}
 
-     while( (current_list -> next) && (current_list -> next < block) ){         // Here we want to find the ordered place
-          current_list = current_list -> next;
+int numa_current_node(){                          // Where the caller runs right now, 0 unless NUMA_ARENAS is 1
+     if( NUMA_ARENAS != 1 ){
+          return 0;
      }
-     block -> next = current_list -> next;
-     block -> prev = current_list;
-     if( current_list -> next ){                                                // If we are not at the end, updated the block's follower with the prev
-          (current_list -> next) -> prev = block;
+     if( numa_thread_node >= 0 ){
+          return numa_thread_node % numa_nodes;
+     }
+     unsigned cpu = 0, node = 0;
+     if( getcpu(&cpu, &node) ){                                                 // vDSO, no syscall on x86-64
+          return 0;
      }
-     current_list -> next = block;                                              
+     return NUMA_SIMULATED_NODES ? (int)(cpu % numa_nodes) : std::min((int)node, numa_nodes - 1);
 }
 
-void remove_from_free_list(MallocMetadata* block, int order){
-     if( block -> prev ){                                                       // If block has previous, bind it to the follower
-          (block -> prev) -> next       = block -> next;
+void numa_place(void* base, size_t length, int node){                          // Sets the page policy before the first touch
+     unsigned long mask = 0;
+     int mode;
+     if( NUMA_ARENAS == 1 ){
+          mask = 1UL << (node % numa_real_nodes);                               // Simulated nodes fold onto the real ones
+          mode = MPOL_PREFERRED;                                                // A full node spills over instead of failing
      }
-     else{                                                                      // Here block is the head
-          free_list[order]              = block -> next;
+     else if( NUMA_ARENAS == 2 ){
+          mask = (numa_real_nodes == BITS_PER_WORD) ? ~0UL : ((1UL << numa_real_nodes) - 1);
+          mode = MPOL_INTERLEAVE;
      }
-     if( block -> next ){                                                       // If block has follower, bind it to the previous
-          (block -> next) -> prev       = block -> prev;
+     else{
+          return;
      }
-     block -> next                      = nullptr;
-     block -> prev                      = nullptr;
+     syscall(SYS_mbind, base, length, mode, &mask, (unsigned long)BITS_PER_WORD + 1, 0);   // Best effort, the kernel may not have NUMA
 }
-//================= Helper related end =================
 
-//=========== malloc_3 implemintations start ===========
-void* smalloc(size_t size){
+void snuma_bind_thread(int node){                 // Pins the calling thread's allocations to one node, -1 follows the CPU again
+     numa_thread_node = (node < 0) ? -1 : node;
+}
+//================== NUMA related end ==================
 
-     static bool list_initialized = false;
-     if( !list_initialized ){
-          initial_allocator();
-          list_initialized = true;
-     }
+//============== Buddy heap related start ==============
+// The buddy core as a template over its geometry, so differently configured heaps can live in one
+// process side by side. An instance owns its arenas and counters and takes no lock, the caller
+// serializes. Instances need static storage (or a zeroed one), there is no constructor to run.
+template<int... O> struct OrderList{};
+template<int N, int... O> struct MakeOrderList : MakeOrderList<N - 1, N - 1, O...>{};
+template<int... O> struct MakeOrderList<0, O...>{ typedef OrderList<O...> type; };
 
-     if(size == ZERO_SIZE_MALLOC_REQ){            // Bullet a. (size is 0), TODO what if size<0?
-          return NULL;
-     }
-     if(size > MAX_SIZE_MALLOC_REQ){              // Bullet b. (size is bigger than 10^8)
-          return NULL;
-     }
+constexpr int floor_log2(size_t n){
+     return (n <= 1) ? 0 : 1 + floor_log2(n >> 1);
+}
 
-     if( size + sizeof(MallocMetadata) >= SIZE_FOR_MMAP ){  // Challenge 3 mmap() usage for >= 128kb
-          void* addr = mmap(nullptr, size + sizeof(MallocMetadata), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-          if( addr == MAP_FAILED ){ return nullptr; }       // mmap failed
+constexpr size_t words_for_bits(size_t bits){
+     return (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
 
-          MallocMetadata* block    = (MallocMetadata*)addr;
-          block -> size            = size + sizeof(MallocMetadata);
-          block -> is_free         = false;
-          block -> is_mmap         = true;
-          block -> order           = -1;
-          block -> next            = mmap_list;
-          if(mmap_list){
-               mmap_list->prev     = block;
-          }
-          block -> prev            = nullptr;
-          mmap_list                = block;
+constexpr size_t order_bitmap_words(int total_blocks, int max_order, int order){      // One bit per block of that order
+     return words_for_bits((size_t)total_blocks << (max_order - order));
+}
 
-          return (void*)(block + 1);
-     }
-     int current_order, target_order = get_order_from_size(size);
-     if( target_order == -1 ){ return nullptr; }  // Case of size too big
+constexpr size_t order_summary_words(int total_blocks, int max_order, int order){     // One bit per bitmap word
+     return words_for_bits(order_bitmap_words(total_blocks, max_order, order));
+}
+
+constexpr size_t order_bitmap_offset(int total_blocks, int max_order, int order){     // Lower orders come first in the flat arrays
+     return (order == 0) ? 0 : order_bitmap_offset(total_blocks, max_order, order - 1) + order_bitmap_words(total_blocks, max_order, order - 1);
+}
 
-     current_order = target_order;
+constexpr size_t order_summary_offset(int total_blocks, int max_order, int order){
+     return (order == 0) ? 0 : order_summary_offset(total_blocks, max_order, order - 1) + order_summary_words(total_blocks, max_order, order - 1);
+}
+
+template<int TotalBlocks, int MaxOrder, typename Orders = typename MakeOrderList<MaxOrder + 1>::type>
+struct OrderTables;
+
+template<int TotalBlocks, int MaxOrder, int... O>
+struct OrderTables<TotalBlocks, MaxOrder, OrderList<O...> >{                  // Every order gets its own slice of the flat bitmaps
+     static constexpr uint32_t bitmap_offset[MaxOrder + 1]  = { (uint32_t)order_bitmap_offset(TotalBlocks, MaxOrder, O)... };
+     static constexpr uint32_t summary_offset[MaxOrder + 1] = { (uint32_t)order_summary_offset(TotalBlocks, MaxOrder, O)... };
+     static constexpr uint32_t summary_words[MaxOrder + 1]  = { (uint32_t)order_summary_words(TotalBlocks, MaxOrder, O)... };
+};
+
+template<int TotalBlocks, int MaxOrder, int... O>
+constexpr uint32_t OrderTables<TotalBlocks, MaxOrder, OrderList<O...> >::bitmap_offset[MaxOrder + 1];
+template<int TotalBlocks, int MaxOrder, int... O>
+constexpr uint32_t OrderTables<TotalBlocks, MaxOrder, OrderList<O...> >::summary_offset[MaxOrder + 1];
+template<int TotalBlocks, int MaxOrder, int... O>
+constexpr uint32_t OrderTables<TotalBlocks, MaxOrder, OrderList<O...> >::summary_words[MaxOrder + 1];
+
+template<size_t MinBlock, int MaxOrder, int TotalBlocks, int MaxArenas = MAX_ARENAS, template<typename> class Ptr = RawPtr>
+struct BuddyHeap{                                               // Ptr is how free blocks link up, OffsetPtr for a region that may move
+     typedef BasicFreeBlock<Ptr> FreeBlock;
+
+     static_assert(MinBlock >= sizeof(FreeBlock) && !(MinBlock & (MinBlock - 1)), "MinBlock must be a power of two that holds a FreeBlock");
+     static_assert(MaxOrder >= 0 && MaxOrder <= 31, "MallocMetadata::order holds orders up to 31");
+     static_assert(TotalBlocks > 0 && !(TotalBlocks & (TotalBlocks - 1)), "Arenas are aligned to their size, so TotalBlocks must be a power of two");
+
+     typedef OrderTables<TotalBlocks, MaxOrder> Tables;
 
-     while( (current_order <= MAX_ORDER) && !free_list[current_order] ){
-          current_order++;
+     static constexpr int      max_order        = MaxOrder;
+     static constexpr int      total_blocks     = TotalBlocks;
+     static constexpr size_t   min_block        = MinBlock;
+     static constexpr int      min_shift        = floor_log2(MinBlock);
+     static constexpr size_t   top_block_size   = MinBlock << MaxOrder;
+     static constexpr size_t   arena_size       = top_block_size * TotalBlocks;             // Every arena is aligned to its own size
+     static constexpr size_t   mmap_threshold   = top_block_size;                           // Requests this big (header included) do not fit a block
+     static constexpr bool     huge_pages       = HUGE_PAGE_ARENAS && !(arena_size % HUGE_PAGE_SIZE);   // Smaller arenas keep base pages
+     static constexpr size_t   purge_granule    = huge_pages ? HUGE_PAGE_SIZE : 0;         // 0 is one base page, known at run time
+     static constexpr bool     file_backed      = !std::is_same<Ptr<FreeBlock>, FreeBlock*>::value;   // Offset links live in a MAP_SHARED file
+     static constexpr size_t   purge_min_block  = huge_pages ? 2 * HUGE_PAGE_SIZE : PURGE_MIN_BLOCK;     // Header granule plus one to give back
+     static constexpr int      purge_min_order  = (MinBlock >= purge_min_block) ? 0 : floor_log2(purge_min_block / MinBlock);
+     static constexpr size_t   bitmap_words     = order_bitmap_offset(TotalBlocks, MaxOrder, MaxOrder + 1);
+     static constexpr size_t   summary_words    = order_summary_offset(TotalBlocks, MaxOrder, MaxOrder + 1);
+
+     struct Arena{                                              // One aligned buddy space, all buddy math is relative to base
+          char*               base;                             // nullptr for an unused slot
+          bool                from_sbrk;
+          int                 node;                             // NUMA node its pages are placed on, 0 without NUMA_ARENAS
+          int                 free_top_blocks;                  // Free MaxOrder blocks, TotalBlocks means fully free
+          Ptr<FreeBlock>      free_list[MaxOrder + 1];          // Array of lists for every order (unordered, bitmaps keep the order)
+          uint64_t            free_bitmap[bitmap_words];        // Bit i of order o is set iff the i-th block of order o is free
+          uint64_t            free_summary[summary_words];      // Bit w of order o is set iff word w of that order's bitmap is non zero
+          uint64_t            slab_bitmap[bitmap_words];        // Same layout as free_bitmap, bit set iff that block is a slab
+          Ptr<FreeBlock>      quick_list[MaxOrder + 1];         // Freed but not merged yet, singly linked, never in free_bitmap
+          int                 quick_count[MaxOrder + 1];
+          int                 live_blocks;                      // Handed out and not back yet, 0 lets the quick lists go
+     };
+
+     Arena               arenas[MaxArenas];                     // Descriptor slots, a live arena never changes slot
+     Arena*              arena_order[MaxArenas];                // Live arenas sorted by base, lowest address is tried first
+     int                 arena_count;
+     int                 arena_slots_used;                      // Slots at or above this were never used
+     size_t              free_per_order[MaxOrder + 1];          // Counters behind the stats
+     size_t              used_per_order[MaxOrder + 1];
+     size_t              dirty_bytes;                           // Free blocks of purge_min_order and up, still resident
+     size_t              purged_bytes;                          // Same blocks after purge_free_blocks (or never touched)
+     size_t              quick_blocks;                          // Blocks on the quick lists, free_per_order counts them too
+     size_t              splits;
+     size_t              merges;
+
+     static int get_order_from_size(size_t request_size){
+          size_t actual_requested_size = request_size + sizeof(MallocMetadata);    // The true size we need calculates the metadata
+          if( actual_requested_size <= MinBlock ){
+               return 0;
+          }
+          int result_order = (BITS_PER_WORD - __builtin_clzll(actual_requested_size - 1)) - min_shift;   // ceil(log2), no loop
+          return ( (result_order > MaxOrder) ? -1 : result_order );
      }
-     if( current_order > MAX_ORDER){ return nullptr; }
 
-     while( current_order > target_order ){       // Buddy splitting proccess
-          MallocMetadata* block = free_list[current_order];
-          remove_from_free_list(block, current_order);
-          current_order--;
+     static size_t bitmap_offset(int order){
+          return Tables::bitmap_offset[order];
+     }
 
-          size_t new_block_size = ZERO_ORDER_BLOCK_SIZE << current_order;
-          MallocMetadata* buddy = (MallocMetadata*)((char*)block + (new_block_size));
+     void initial_arena(Arena* arena, char* base, bool from_sbrk, int node = 0){
+          std::memset((void*)arena, 0, sizeof(Arena));                         // Offset links are zero when null too
+          arena -> from_sbrk = from_sbrk;
+          arena -> node      = node;
+          __atomic_store_n(&arena->base, base, __ATOMIC_RELEASE);               // Lock free lookups in arena_of read this
 
-          block -> size            = new_block_size;
-          block -> is_free         = true;
-          block -> is_mmap         = false;
-          block -> order           = current_order;
+          for(int i=0 ; i<TotalBlocks ; ++i){
+               MallocMetadata* block    = (MallocMetadata*)(base + (i * top_block_size));
+               block -> size            = top_block_size;
+               block -> is_free         = true;
+               block -> is_mmap         = false;
+               block -> is_aligned      = false;
+               block -> is_zero         = true;                                 // Fresh sbrk / mmap pages
+               block -> is_purged       = true;                                 // Not resident yet, nothing to give back
+               block -> order           = MaxOrder;
+               insert_to_free_list(arena, block, block -> order);
+          }
 
-          buddy -> size            = new_block_size;
-          buddy -> is_free         = true;
-          buddy -> is_mmap         = false;
-          buddy -> order           = current_order;
+          int index = arena_count++;                                            // Keep arena_order sorted by address
+          while( MaxArenas > 1 && index > 0 && arena_order[index - 1]->base > base ){
+               arena_order[index] = arena_order[index - 1];
+               index--;
+          }
+          arena_order[index] = arena;
+          int slot = arena - arenas;
+          if( slot >= arena_slots_used ){
+               __atomic_store_n(&arena_slots_used, slot + 1, __ATOMIC_RELEASE);
+          }
+     }
 
-          insert_to_free_list(block, current_order);
-          insert_to_free_list(buddy, current_order);
+     Arena* add_arena(int node = 0){
+          Arena* arena = nullptr;
+          for(int i=0 ; i<MaxArenas && !arena ; ++i){
+               if( !arenas[i].base ){
+                    arena = &arenas[i];
+               }
+          }
+          if( !arena ){
+               return nullptr;                                                  // Out of descriptor slots
+          }
+          void* raw = MAP_FAILED;
+          bool hugetlb = false;
+#ifdef MAP_HUGETLB
+          if( huge_pages && HUGE_PAGE_ARENAS == 2 ){                          // Needs pages reserved in vm.nr_hugepages
+               raw = mmap(nullptr, 2 * arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+               hugetlb = (raw != MAP_FAILED);
+          }
+#endif
+          if( raw == MAP_FAILED ){                                              // No reserve left, fall back to ordinary pages
+               raw = mmap(nullptr, 2 * arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          }
+          if( raw == MAP_FAILED ){
+               return nullptr;
+          }
+          char* base = (char*)(((uintptr_t)raw + arena_size - 1) & ~(arena_size - 1));   // Same alligment trick, then trim both ends
+          if( base > (char*)raw ){
+               munmap(raw, base - (char*)raw);                                  // Whole huge pages, the mapping is huge page aligned
+          }
+          munmap(base + arena_size, ((char*)raw + 2 * arena_size) - (base + arena_size));
+#ifdef MADV_HUGEPAGE
+          if( huge_pages && !hugetlb ){
+               madvise(base, arena_size, MADV_HUGEPAGE);                        // Aligned to its size, so every 2 MiB of it can fault in as one page
+          }
+#endif
+          numa_place(base, arena_size, node);
+          initial_arena(arena, base, false, node);
+          return arena;
      }
-     MallocMetadata* block = free_list[target_order];
-     remove_from_free_list(block, target_order);
-     block -> is_free = false;                    // Actual allocation
 
-     return (void*)(block+1);
-}
+     void release_arena(Arena* arena){
+          int index = 0;
+          while( arena_order[index] != arena ){
+               index++;
+          }
+          arena_count--;
+          for( ; index<arena_count ; ++index){
+               arena_order[index] = arena_order[index + 1];
+          }
+          char* base = arena -> base;
+          free_per_order[MaxOrder] -= TotalBlocks;                              // Its free blocks leave with it
+          for(FreeBlock* block = arena->free_list[MaxOrder] ; block ; block = block->next){
+               if( MaxOrder >= purge_min_order ){
+                    (block->header.is_purged ? purged_bytes : dirty_bytes) -= block->header.size;
+               }
+          }
+          __atomic_store_n(&arena->base, (char*)nullptr, __ATOMIC_RELEASE);
+          munmap(base, arena_size);
+     }
 
-void* scalloc(size_t num, size_t size){
+     Arena* arena_of(void* p){
+          char* base = (char*)((uintptr_t)p & ~(arena_size - 1));               // The arena is found from the pointer alignment
+          int slots  = __atomic_load_n(&arena_slots_used, __ATOMIC_ACQUIRE);
+          for(int i=0 ; i<slots ; ++i){
+               if( __atomic_load_n(&arenas[i].base, __ATOMIC_ACQUIRE) == base ){
+                    return &arenas[i];
+               }
+          }
+          return nullptr;
+     }
 
-     if(num == ZERO_SIZE_MALLOC_REQ || size == ZERO_SIZE_MALLOC_REQ){           // Bullet a. (size is 0), TODO what if size<0?
-          return NULL;
+     void set_free_bit(Arena* arena, size_t offset, int order){
+          size_t index = offset >> (order + min_shift);                         // Block index inside the order
+          size_t word  = index / BITS_PER_WORD;
+          arena -> free_bitmap[Tables::bitmap_offset[order] + word]  |= ((uint64_t)1 << (index % BITS_PER_WORD));
+          arena -> free_summary[Tables::summary_offset[order] + word / BITS_PER_WORD] |= ((uint64_t)1 << (word % BITS_PER_WORD));
      }
-     size_t total_size = num*size;
-     if((total_size) > MAX_SIZE_MALLOC_REQ){                                    // Bullet b. (size is bigger than 10^8)
-          return NULL;
+
+     void clear_free_bit(Arena* arena, size_t offset, int order){
+          size_t index = offset >> (order + min_shift);
+          size_t word  = index / BITS_PER_WORD;
+          uint64_t* bits = &arena->free_bitmap[Tables::bitmap_offset[order] + word];
+          *bits &= ~((uint64_t)1 << (index % BITS_PER_WORD));
+          if( !*bits ){                                                         // Word became empty, so clear it in the summary too
+               arena -> free_summary[Tables::summary_offset[order] + word / BITS_PER_WORD] &= ~((uint64_t)1 << (word % BITS_PER_WORD));
+          }
      }
 
-     void* new_block = smalloc(total_size);
-     if(!new_block){
-          return NULL;
+     bool test_free_bit(Arena* arena, size_t offset, int order){
+          size_t index = offset >> (order + min_shift);
+          return (arena->free_bitmap[Tables::bitmap_offset[order] + index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1;
      }
 
-     std::memset(new_block, 0, total_size);
-     return new_block;
-}
+     MallocMetadata* find_first_free_block(Arena* arena, int order){
+          for(size_t s=0 ; s<Tables::summary_words[order] ; ++s){               // Find first set, summary first and then the word itself
+               uint64_t summary = arena->free_summary[Tables::summary_offset[order] + s];
+               if( !summary ){
+                    continue;
+               }
+               size_t word    = s * BITS_PER_WORD + __builtin_ctzll(summary);
+               size_t index   = word * BITS_PER_WORD + __builtin_ctzll(arena->free_bitmap[Tables::bitmap_offset[order] + word]);
+               return (MallocMetadata*)(arena->base + (index << (order + min_shift)));
+          }
+          return nullptr;
+     }
 
-void sfree(void* p){
+     void insert_to_free_list(Arena* arena, MallocMetadata* block, int order){
+          FreeBlock* free_block         = (FreeBlock*)block;
+          Ptr<FreeBlock>& head          = arena->free_list[order];
+          free_block -> next            = head;                                 // O(1) push, the address order lives in the bitmap
+          free_block -> prev            = nullptr;
+          if( head ){
+               head -> prev             = free_block;
+          }
+          head                          = free_block;
+          set_free_bit(arena, (char*)block - arena->base, order);
+          free_per_order[order]++;
+          if( order == MaxOrder ){
+               arena -> free_top_blocks++;
+          }
+          if( order >= purge_min_order ){
+               (block->is_purged ? purged_bytes : dirty_bytes) += block->size;
+          }
+     }
 
-     if(p == NULL){
-          return;                  // Second bullet
+     void remove_from_free_list(Arena* arena, MallocMetadata* block, int order){
+          FreeBlock* free_block = (FreeBlock*)block;
+          if( free_block -> prev ){                                             // If block has previous, bind it to the follower
+               (free_block -> prev) -> next  = free_block -> next;
+          }
+          else{                                                                 // Here block is the head
+               arena -> free_list[order]     = free_block -> next;
+          }
+          if( free_block -> next ){                                             // If block has follower, bind it to the previous
+               (free_block -> next) -> prev  = free_block -> prev;
+          }
+          clear_free_bit(arena, (char*)block - arena->base, order);
+          free_per_order[order]--;
+          if( order == MaxOrder ){
+               arena -> free_top_blocks--;
+          }
+          if( order >= purge_min_order ){
+               (block->is_purged ? purged_bytes : dirty_bytes) -= block->size;
+          }
      }
-     MallocMetadata* block_Metadata = (((MallocMetadata*)p) - 1);
-     if(block_Metadata -> is_free) {
-          return;
+
+     MallocMetadata* arena_allocate(Arena* arena, int target_order){
+          if( DEFERRED_COALESCE && arena->quick_list[target_order] ){          // Same order freed recently, no split at all
+               MallocMetadata* block = quick_pop(arena, target_order);
+               block -> is_free = false;
+               used_per_order[target_order]++;
+               arena -> live_blocks++;
+               return block;
+          }
+          int current_order = target_order;
+
+          while( (current_order <= MaxOrder) && !arena->free_list[current_order] ){
+               current_order++;
+          }
+          if( current_order > MaxOrder){
+               if( DEFERRED_COALESCE && drain_quick_lists(arena) ){            // The merges we put off may make room
+                    return arena_allocate(arena, target_order);
+               }
+               return nullptr;
+          }
+
+          while( current_order > target_order ){  // Buddy splitting proccess
+               MallocMetadata* block = find_first_free_block(arena, current_order);   // Lowest address first
+               remove_from_free_list(arena, block, current_order);
+               current_order--;
+               splits++;
+
+               size_t new_block_size = MinBlock << current_order;
+               MallocMetadata* buddy = (MallocMetadata*)((char*)block + (new_block_size));
+
+               block -> size            = new_block_size;
+               block -> is_free         = true;
+               block -> is_mmap         = false;
+               block -> is_aligned      = false;
+               block -> order           = current_order;
+
+               buddy -> size            = new_block_size;
+               buddy -> is_free         = true;
+               buddy -> is_mmap         = false;
+               buddy -> is_aligned      = false;
+               buddy -> is_zero         = block -> is_zero;                     // Halves of a clean block are clean
+               buddy -> is_purged       = block -> is_purged;                   // Only its new header page comes back
+               buddy -> order           = current_order;
+
+               insert_to_free_list(arena, block, current_order);
+               insert_to_free_list(arena, buddy, current_order);
+          }
+          MallocMetadata* block = find_first_free_block(arena, target_order);
+          remove_from_free_list(arena, block, target_order);
+          block -> is_free = false;               // Actual allocation
+          used_per_order[target_order]++;
+          arena -> live_blocks++;
+
+          return block;
      }
-     if(block_Metadata->is_mmap){
-          if(block_Metadata->prev){
-               (block_Metadata->prev)->next  = block_Metadata->next;
+
+     MallocMetadata* buddy_allocate(int target_order, int node = 0){
+          for(int i=0 ; DEFERRED_COALESCE && quick_blocks && i<arena_count ; ++i){   // An exact fit parked in any arena beats a split
+               if( arena_order[i]->node == node && arena_order[i]->quick_list[target_order] ){
+                    return arena_allocate(arena_order[i], target_order);
+               }
           }
-          else{
-               mmap_list                     = block_Metadata -> next;
+          for(int i=0 ; i<arena_count ; ++i){     // Lowest arena of the node first keeps the address ordered policy
+               MallocMetadata* block = (arena_order[i]->node == node) ? arena_allocate(arena_order[i], target_order) : nullptr;
+               if( block ){
+                    return block;
+               }
           }
-          if(block_Metadata->next){
-               (block_Metadata->next)->prev  = block_Metadata ->prev;
+          Arena* arena = add_arena(node);         // Under pressure, grow by one more arena
+          if( arena ){
+               return arena_allocate(arena, target_order);
           }
-          munmap((void*)block_Metadata, block_Metadata->size);
-          return;
+          for(int i=0 ; i<arena_count ; ++i){     // Out of arenas, remote memory still beats failing
+               MallocMetadata* block = (arena_order[i]->node != node) ? arena_allocate(arena_order[i], target_order) : nullptr;
+               if( block ){
+                    return block;
+               }
+          }
+          return nullptr;
      }
-     block_Metadata -> is_free = true;
-     
-     while( block_Metadata -> order < MAX_ORDER ){
-          size_t block_size             = ZERO_ORDER_BLOCK_SIZE << block_Metadata->order;
-          size_t offset                 = (char*)block_Metadata - (char*)base_address;
-          size_t buddy_offset           = offset ^ block_size;
-          MallocMetadata* buddy         = (MallocMetadata*)((char*)base_address + buddy_offset);
 
-          if( !(buddy->is_free && (buddy->order == block_Metadata->order)) ){
-               break;                                                 // Make sure buddy has same is_dree and order
+     void buddy_free(MallocMetadata* block_Metadata){
+          block_Metadata -> is_free = true;
+          block_Metadata -> is_zero = false;      // Whatever it merges with, the result holds used bytes
+          block_Metadata -> is_purged = false;
+          int order = block_Metadata -> order;
+          used_per_order[order]--;
+          Arena* arena = arena_of(block_Metadata);
+          arena -> live_blocks--;
+          if( DEFERRED_COALESCE && order < MaxOrder ){
+               quick_push(arena, block_Metadata);
+               if( arena->quick_count[order] > QUICK_LIST_LIMIT ){
+                    drain_quick_list(arena, order);                             // Merge the whole list in one go
+               }
+               release_or_purge(arena);                                         // quick_push added to dirty_bytes, the purge drains quick lists too
+               return;
           }
-          remove_from_free_list(buddy, buddy->order);
+          coalesce_and_insert(arena, block_Metadata);
+     }
 
-          MallocMetadata* merged = (block_Metadata < buddy) ? block_Metadata : buddy;    // Merge be choosing the smaller
-          merged->order++;
-          merged->size = (ZERO_ORDER_BLOCK_SIZE << (merged->order));
-          block_Metadata = merged;
+     void quick_push(Arena* arena, MallocMetadata* block){                    // A free block that skips the merge, for now
+          FreeBlock* free_block         = (FreeBlock*)block;
+          int order                     = block -> order;
+          free_block -> next            = arena -> quick_list[order];
+          free_block -> prev            = nullptr;
+          arena -> quick_list[order]    = free_block;
+          arena -> quick_count[order]++;
+          quick_blocks++;
+          free_per_order[order]++;
+          if( order >= purge_min_order ){
+               dirty_bytes             += block->size;
+          }
      }
-     insert_to_free_list(block_Metadata, block_Metadata->order);
-}
 
-void* srealloc(void* oldp, size_t size){
+     MallocMetadata* quick_pop(Arena* arena, int order){
+          FreeBlock* free_block         = arena -> quick_list[order];
+          arena -> quick_list[order]    = free_block -> next;
+          arena -> quick_count[order]--;
+          quick_blocks--;
+          free_per_order[order]--;
+          if( order >= purge_min_order ){
+               dirty_bytes             -= free_block->header.size;
+          }
+          return &free_block->header;
+     }
 
-     if(size == ZERO_SIZE_MALLOC_REQ){            // Bullet a. (size is 0), TODO what if size<0?
-          return NULL;
+     void drain_quick_list(Arena* arena, int order){
+          while( arena->quick_list[order] ){
+               merge_and_insert(arena, quick_pop(arena, order));
+          }
      }
-     if(size > MAX_SIZE_MALLOC_REQ){              // Bullet b. (size is bigger than 10^8)
-          return NULL;
+
+     bool drain_quick_lists(Arena* arena){        // Returns whether there was anything to merge
+          bool drained = false;
+          for(int order=0 ; order<MaxOrder ; ++order){
+               drained = drained || arena->quick_list[order];
+               drain_quick_list(arena, order);
+          }
+          return drained;
      }
-     if(oldp == NULL){
-          return smalloc(size);                   // Bullet Succes.b. smalloc equivalant
+
+     void coalesce_and_insert(Arena* arena, MallocMetadata* block_Metadata){
+          merge_and_insert(arena, block_Metadata);
+          release_or_purge(arena);
      }
-     MallocMetadata* block_Metadata = (((MallocMetadata*)oldp) - 1);
-     size_t required_size = size + sizeof(MallocMetadata);
 
-     if(block_Metadata->is_mmap){
-          if(block_Metadata->size == required_size){
-               return oldp;
+     void merge_and_insert(Arena* arena, MallocMetadata* block_Metadata){
+          while( block_Metadata -> order < MaxOrder ){
+               size_t block_size             = MinBlock << block_Metadata->order;
+               size_t offset                 = (char*)block_Metadata - arena->base;
+               size_t buddy_offset           = offset ^ block_size;
+               MallocMetadata* buddy         = (MallocMetadata*)(arena->base + buddy_offset);
+
+               if( !test_free_bit(arena, buddy_offset, block_Metadata->order) ){
+                    break;                                                      // Bit is set only for a free buddy of the same order
+               }
+               remove_from_free_list(arena, buddy, buddy->order);
+
+               bool is_purged = block_Metadata->is_purged && buddy->is_purged;
+               MallocMetadata* merged = (block_Metadata < buddy) ? block_Metadata : buddy;    // Merge be choosing the smaller
+               merged->order++;
+               merged->size = (MinBlock << (merged->order));
+               merged->is_zero = false;
+               merged->is_purged = is_purged;
+               block_Metadata = merged;
+               merges++;
+          }
+          insert_to_free_list(arena, block_Metadata, block_Metadata->order);
+     }
+
+     void release_or_purge(Arena* arena){         // After a free, the arena may be empty or the heap too dirty
+          if( !arena->live_blocks ){
+               release_surplus();
+          }
+          if( !file_backed && PURGE_THRESHOLD != 0 && dirty_bytes > PURGE_THRESHOLD ){
+               purge_free_blocks();               // Bursty workloads do not keep their peak RSS forever
+          }
+     }
+
+     void release_surplus(){                      // Fully free arenas above the high-water mark go back to the OS, whichever emptied last
+          int fully_free = 0;
+          for(int i=0 ; i<arena_count ; ++i){                                   // No live blocks, merged or only waiting for it
+               fully_free += !arena_order[i]->live_blocks;
+          }
+          for(int a=arena_count - 1 ; a>=0 && fully_free > ARENA_FREE_HIGH_WATER ; --a){   // Highest first, low arenas are tried first and stay
+               Arena* arena = arena_order[a];
+               if( arena->live_blocks || arena->from_sbrk ){
+                    continue;                     // The sbrk arena counts, but only mmap ones can go
                }
-               void* new_block = smalloc(size);
-               if(!new_block) {
-                    return NULL;
+               if( DEFERRED_COALESCE ){
+                    drain_quick_lists(arena);
                }
-               std::memmove(new_block, oldp, std::min(block_Metadata->size - sizeof(MallocMetadata), size));
-               sfree(oldp);
-               return new_block;
+               if( arena->free_top_blocks == TotalBlocks ){
+                    release_arena(arena);         // Backwards, a release only moves the arenas above
+                    fully_free--;
+               }
+          }
      }
 
-     if(block_Metadata->size >= required_size){         // Re-use the oldp, it is good enuogh
-          return oldp;
-     }
-
-     MallocMetadata* simulated = block_Metadata;  // Here we are not mmap
-     int current_order = simulated->order;
-     size_t offset = (char*)simulated - (char*)base_address;
- 
-     while(current_order < MAX_ORDER){
-          size_t block_size = ZERO_ORDER_BLOCK_SIZE << current_order;
-          size_t buddy_offset = offset ^ block_size;
-          MallocMetadata* buddy = (MallocMetadata*)((char*)base_address + buddy_offset);
-     
-          if (!(buddy->is_free && buddy->order == current_order)) {
-               break;
+     size_t purge_free_blocks(){                  // Returns the bytes handed back
+          if( file_backed ){
+               return 0;                          // MADV_DONTNEED on a shared file mapping frees no file blocks
           }
- 
-          size_t merged_size = ZERO_ORDER_BLOCK_SIZE << (current_order + 1);
-          if(merged_size >= required_size) {
-               sfree(oldp);                            // sfree merge usage
-               void* new_block = smalloc(size);
-               if (new_block) {
-                    std::memmove(new_block, oldp, std::min(block_Metadata->size - sizeof(MallocMetadata), size));
+          size_t granule = purge_granule ? purge_granule : page_size;          // Never madvise part of a huge page, the kernel would split it
+          size_t purged = 0;
+          for(int a=0 ; DEFERRED_COALESCE && a<arena_count ; ++a){             // Quick list blocks are dirty too, merge them first
+               drain_quick_lists(arena_order[a]);
+          }
+          release_surplus();
+          for(int a=0 ; a<arena_count ; ++a){
+               Arena* arena = arena_order[a];
+               for(int order=MaxOrder ; order>=purge_min_order ; --order){
+                    for(FreeBlock* block = arena->free_list[order] ; block ; block = block->next){
+                         MallocMetadata* header = &block->header;
+                         if( header->is_purged || header->size <= granule ){
+                              continue;           // Already gone, a second madvise would only cost a syscall
+                         }
+                         madvise((char*)header + granule, header->size - granule, PURGE_ADVICE);   // The header granule keeps the links
+                         header -> is_purged  = true;
+                         dirty_bytes         -= header->size;
+                         purged_bytes        += header->size;
+                         purged              += header->size - granule;
+                    }
                }
-               return new_block;
           }
-          current_order++;
+          return purged;
      }
 
-     void* new_block = smalloc(size);             // If here we need a new memory allocation
-     if(!new_block){
-          return NULL;
+     bool rebuild_from_headers(){                 // Free lists, bitmaps and counters again from the block headers alone
+          size_t kept_splits = splits, kept_merges = merges;
+          std::memset(free_per_order, 0, sizeof(free_per_order));
+          std::memset(used_per_order, 0, sizeof(used_per_order));
+          dirty_bytes = purged_bytes = quick_blocks = 0;
+          for(int a=0 ; a<arena_count ; ++a){     // Slab bits stay, slabs are live blocks
+               Arena* arena = arena_order[a];
+               std::memset((void*)arena->free_list, 0, sizeof(arena->free_list));
+               std::memset((void*)arena->quick_list, 0, sizeof(arena->quick_list));
+               std::memset(arena->quick_count, 0, sizeof(arena->quick_count));
+               std::memset(arena->free_bitmap, 0, sizeof(arena->free_bitmap));
+               std::memset(arena->free_summary, 0, sizeof(arena->free_summary));
+               arena -> free_top_blocks = 0;
+               arena -> live_blocks     = 0;
+          }
+          for(int a=0 ; a<arena_count ; ++a){
+               Arena* arena = arena_order[a];
+               for(size_t offset=0 ; offset<arena_size ; ){                    // Same walk as check_arena, in address order
+                    MallocMetadata* block = (MallocMetadata*)(arena->base + offset);
+                    int order = block -> order;
+                    if( order < 0 || order > MaxOrder || block->size != (MinBlock << order) || block->is_mmap ||
+                        block->is_aligned || (offset & (block->size - 1)) ){
+                         return false;                                          // Torn header, nothing to walk on from here
+                    }
+                    offset += block->size;
+                    if( block->is_free ){
+                         merge_and_insert(arena, block);                        // A lower free buddy is already in, quick list leftovers merge too
+                    }
+                    else{
+                         used_per_order[order]++;
+                         arena -> live_blocks++;
+                    }
+               }
+          }
+          splits = kept_splits;
+          merges = kept_merges;
+          return true;
      }
 
-     std::memmove(new_block, oldp, block_Metadata->size);
-     sfree(oldp);
+     MallocMetadata* merge_for_growth(MallocMetadata* block, int target_order){
+          Arena* arena = arena_of(block);
+          size_t offset = (char*)block - arena->base;
+          size_t merged_offset = offset;
+          for(int order = block->order ; order < target_order ; ++order){      // Dry run, every buddy on the way up must be free
+               size_t buddy_offset = merged_offset ^ (MinBlock << order);
+               if( !test_free_bit(arena, buddy_offset, order) ){
+                    return nullptr;
+               }
+               merged_offset &= ~(MinBlock << order);
+          }
+          merged_offset = offset;
+          for(int order = block->order ; order < target_order ; ++order){      // Absorb them straight into the live block
+               size_t buddy_offset = merged_offset ^ (MinBlock << order);
+               remove_from_free_list(arena, (MallocMetadata*)(arena->base + buddy_offset), order);
+               merged_offset &= ~(MinBlock << order);
+          }
+          MallocMetadata* merged   = (MallocMetadata*)(arena->base + merged_offset);
+          merges                  += target_order - block->order;
+          used_per_order[block->order]--;
+          used_per_order[target_order]++;
+          merged -> size           = MinBlock << target_order;
+          merged -> order          = target_order;
+          merged -> is_free        = false;
+          merged -> is_mmap        = false;
+          merged -> is_aligned     = false;
+          merged -> is_zero        = false;
+          merged -> is_purged      = false;
+          return merged;
+     }
 
-     return new_block;
+     void shrink_in_place(MallocMetadata* block, int target_order){
+          Arena* arena = arena_of(block);
+          if( block->order > target_order ){
+               used_per_order[block->order]--;
+               used_per_order[target_order]++;
+               splits += block->order - target_order;
+          }
+          while( block->order > target_order ){                                 // Split off the upper half and give it back
+               block -> order--;
+               block -> size            = MinBlock << block->order;
+               MallocMetadata* upper    = (MallocMetadata*)((char*)block + block->size);
+               upper -> size            = block -> size;
+               upper -> order           = block -> order;
+               upper -> is_free         = true;
+               upper -> is_mmap         = false;
+               upper -> is_aligned      = false;
+               upper -> is_zero         = false;
+               upper -> is_purged       = false;
+               insert_to_free_list(arena, upper, upper->order);                // Its buddy is the live block, nothing to merge
+          }
+     }
+};
+
+typedef BuddyHeap<ZERO_ORDER_BLOCK_SIZE, MAX_ORDER, TOTAL_BLOCKS> DefaultHeap;
+typedef DefaultHeap::Arena Arena;
+
+DefaultHeap heap;                                               // smalloc and friends, guarded by heap_lock
+//=============== Buddy heap related end ===============
+
+//================ Helper related start ================
+void initial_allocator();
+void* smalloc_slow(size_t size) __attribute__((noinline));
+void sfree_slow(void* p) __attribute__((noinline));
+MallocMetadata* header_of(void* p);
+void seal_header(MallocMetadata* header);
+void heap_corruption(const char* what, const void* where) __attribute__((noreturn, cold));
+MallocMetadata* thread_cache_pop(int order);
+void thread_cache_push(MallocMetadata* block);
+void thread_cache_exit(void* arg);
+void snapshot_stats_locked(MallocStats* stats);
+void telemetry_start();
+void telemetry_after_fork();
 
+void fork_prepare(){                              // No other thread may hold the heap across fork()
+     pthread_mutex_lock(&profile_lock);
+     pthread_mutex_lock(&heap_lock);
 }
-//============ malloc_3 implemintations end ============
 
-size_t _num_free_blocks(){
-     size_t free_blocks_count = 0;
-     for(int i = 0 ; i<=MAX_ORDER ; i++){
-          MallocMetadata* current_p = free_list[i];
-          while(current_p){
-               free_blocks_count++;
-               current_p = current_p->next;
+void fork_parent(){
+     pthread_mutex_unlock(&heap_lock);
+     pthread_mutex_unlock(&profile_lock);
+}
+
+void fork_child(){                                // The child only has the forking thread, start it with fresh locks
+     pthread_mutex_init(&heap_lock, nullptr);
+     pthread_mutex_init(&profile_lock, nullptr);
+     telemetry_after_fork();
+}
+
+void initial_allocator(){
+
+     in_initial_allocator = true;                 // Anything below may call back into malloc (perror, pthread_atfork)
+     page_size = sysconf(_SC_PAGESIZE);
+     const void* random = (const void*)getauxval(AT_RANDOM);                   // 16 bytes the kernel hands every process, no syscall
+     header_secret = (uint64_t)(uintptr_t)&heap;
+     if( random ){
+          std::memcpy(&header_secret, random, sizeof(header_secret));        // No alignment promised, so no uint64_t load
+     }
+     header_secret |= 1;
+     if( NUMA_ARENAS ){
+          numa_real_nodes = numa_detect_nodes();
+          numa_nodes      = NUMA_SIMULATED_NODES ? std::min(NUMA_SIMULATED_NODES, NUMA_MAX_NODES) : numa_real_nodes;
+     }
+
+     if( DefaultHeap::huge_pages || NUMA_ARENAS ){                              // Huge page and NUMA arenas are all mmap backed, sbrk is left alone
+          if( !heap.add_arena(numa_current_node()) ){
+               perror("mmap failed in the initial_allocator");
+               exit(1);
           }
      }
-     return free_blocks_count;
+     else{
+          void* curr = sbrk(0);                                                 // Your alligment trick
+          char* curr_ptr = (char*)curr;
+          size_t align_size = DefaultHeap::arena_size;
+          size_t offset = (size_t)curr_ptr % align_size;
+          size_t padding = (offset == 0) ? 0 : (align_size-offset);
+
+          void* raw = sbrk(padding + DefaultHeap::arena_size);
+          if( raw == (void*)FAIL_SBRK_MALLOC_REQ ){
+               perror("sbrk failed in the initial_allocator");                  // Some error handling
+               exit(1);
+          }
+
+          heap.initial_arena(&heap.arenas[0], (char*)raw + padding, true);      // Initial size for 32 free blocks, each is 10 order
+     }
+     if( THREAD_CACHE ){
+          pthread_key_create(&thread_cache_key, thread_cache_exit);
+     }
+     telemetry_start();
+     pthread_atfork(fork_prepare, fork_parent, fork_child);
+     in_initial_allocator = false;
 }
-size_t _num_free_bytes(){
-     size_t free_bytes_count = 0;
-     for(int i = 0 ; i<=MAX_ORDER ; i++){
-          MallocMetadata* current_p = free_list[i];
-          while(current_p){
-               free_bytes_count += (current_p->size - sizeof(MallocMetadata));
-               current_p = current_p->next;
+
+//================= Helper related end =================
+
+//============= Thread cache related start =============
+struct ThreadCache{                                             // Plain data in static TLS, a fast path access is one %fs relative load
+     MallocMetadata*     blocks[THREAD_CACHE_MAX_ORDER + 1][THREAD_CACHE_CAPACITY];
+     int                 count[THREAD_CACHE_MAX_ORDER + 1];     // Written by the owner only, read by the stats under heap_lock
+     bool                registered;                            // On thread_caches, frees only go to registered caches
+     ThreadCache*        next;
+     ThreadCache*        prev;
+};
+
+thread_local ThreadCache thread_cache __attribute__((tls_model("initial-exec")));   // Zero initialized per thread
+ThreadCache* thread_caches               = nullptr;         // Every cache that may hold blocks, guarded by heap_lock
+
+inline void set_cached(ThreadCache& cache, int order, int count){
+     __atomic_store_n(&cache.count[order], count, __ATOMIC_RELAXED);
+}
+
+void thread_cache_totals(size_t* blocks, size_t* bytes){      // heap_lock held
+     *blocks = *bytes = 0;
+     for(ThreadCache* cache = thread_caches ; cache ; cache = cache->next){
+          for(int order=0 ; order<=THREAD_CACHE_MAX_ORDER ; ++order){
+               size_t count = __atomic_load_n(&cache->count[order], __ATOMIC_RELAXED);
+               *blocks += count;
+               *bytes  += count * ((ZERO_ORDER_BLOCK_SIZE << order) - sizeof(MallocMetadata));
           }
      }
-     return free_bytes_count;
 }
-size_t _num_allocated_blocks(){
-     if (base_address == nullptr) {
-          return 0;
+
+void thread_cache_register(ThreadCache& cache){                // Before the first block goes in, heap_lock held
+     cache.prev = nullptr;
+     cache.next = thread_caches;
+     if( cache.next ){
+          cache.next -> prev           = &cache;
      }
-     size_t alloced_blocks_count = 0;
-     for(int i=0 ; i<=MAX_ORDER ; i++){           // Count the free blocks
-          MallocMetadata* block = free_list[i];
-          while(block){
-               alloced_blocks_count++;
-               block = block->next;
-          }
+     thread_caches      = &cache;
+     cache.registered   = true;
+     pthread_setspecific(thread_cache_key, &cache);
+}
+
+void thread_cache_unregister(ThreadCache& cache){              // heap_lock held, the cache is empty
+     if( cache.prev ){
+          cache.prev -> next           = cache.next;
      }
-     size_t offset = 0;
-     while(offset < INITIAL_HEAP_SIZE){           // Count the !free blocks
-          MallocMetadata* block = (MallocMetadata*)((char*)base_address + offset);
-          if( !block->is_free && !block->is_mmap ){
-               alloced_blocks_count++;
-          }
-          offset += block->size;
+     else{
+          thread_caches                = cache.next;
      }
-     MallocMetadata* mmap_curr = mmap_list;
-     while (mmap_curr) {
-          alloced_blocks_count++;
-         mmap_curr = mmap_curr->next;
+     if( cache.next ){
+          cache.next -> prev           = cache.prev;
      }
-     return alloced_blocks_count;
+     cache.next = cache.prev = nullptr;
+     cache.registered   = false;
 }
-size_t _num_allocated_bytes(){
-     if (base_address == nullptr) {
-          return 0;
+
+void thread_cache_flush(int order, int amount){
+     ThreadCache& cache = thread_cache;
+     pthread_mutex_lock(&heap_lock);
+     for(int i=0 ; i<amount ; ++i){                                             // Oldest blocks go back first, the hot ones stay
+          MallocMetadata* block = cache.blocks[order][i];
+          block -> is_free = false;                                             // buddy_free expects a live block
+          heap.buddy_free(block);
      }
-     size_t alloced_bytes_count = 0;
-          for(int i=0 ; i<=MAX_ORDER ; i++){           // Count the free blocks
-          MallocMetadata* block = free_list[i];
-          while(block){
-               alloced_bytes_count += (block->size - sizeof(MallocMetadata));
-               block = block->next;
+     set_cached(cache, order, cache.count[order] - amount);                     // Under the lock, so the stats see the blocks once
+     pthread_mutex_unlock(&heap_lock);
+     std::memmove(cache.blocks[order], cache.blocks[order] + amount, cache.count[order] * sizeof(MallocMetadata*));
+}
+
+MallocMetadata* thread_cache_pop(int order){
+     ThreadCache& cache = thread_cache;
+     if( !cache.count[order] ){                                                 // Empty magazine, refill a batch under one lock
+          int refilled = 0;
+          int node = numa_current_node();
+          pthread_mutex_lock(&heap_lock);
+          if( !cache.registered ){
+               thread_cache_register(cache);
           }
-     }
-     size_t offset = 0;
-     while(offset < INITIAL_HEAP_SIZE){           // Count the !free blocks
-          MallocMetadata* block = (MallocMetadata*)((char*)base_address + offset);
-          if( !block->is_free && !block->is_mmap ){
-               alloced_bytes_count += (block->size - sizeof(MallocMetadata));
+          while( refilled < THREAD_CACHE_BATCH ){
+               MallocMetadata* block = heap.buddy_allocate(order, node);
+               if( !block ){
+                    break;
+               }
+               block -> is_free = true;                                         // Free from the user's view while it sits in the cache
+               cache.blocks[order][refilled++] = block;
+          }
+          for(int i=0 ; i<refilled/2 ; ++i){                                    // Keep the lowest address on top of the stack
+               std::swap(cache.blocks[order][i], cache.blocks[order][refilled - 1 - i]);
+          }
+          set_cached(cache, order, refilled);
+          pthread_mutex_unlock(&heap_lock);
+          if( !refilled ){
+               return nullptr;
           }
-          offset += block->size;
      }
-     MallocMetadata* mmap_curr = mmap_list;
-     while (mmap_curr) {
-          alloced_bytes_count += (mmap_curr->size - sizeof(MallocMetadata));
-         mmap_curr = mmap_curr->next;
+     MallocMetadata* block = cache.blocks[order][cache.count[order] - 1];
+     set_cached(cache, order, cache.count[order] - 1);
+     block -> is_free = false;
+     return block;
+}
+
+void thread_cache_push(MallocMetadata* block){
+     ThreadCache& cache = thread_cache;
+     int order = block -> order;
+     if( !cache.registered ){
+          pthread_mutex_lock(&heap_lock);
+          thread_cache_register(cache);
+          pthread_mutex_unlock(&heap_lock);
      }
-     return alloced_bytes_count;
+     if( cache.count[order] == THREAD_CACHE_CAPACITY ){
+          thread_cache_flush(order, THREAD_CACHE_BATCH);
+     }
+     block -> is_free = true;
+     block -> is_zero = false;                    // Skips buddy_free, so drop the clean mark here
+     cache.blocks[order][cache.count[order]] = block;
+     set_cached(cache, order, cache.count[order] + 1);
+}
+
+void thread_cache_exit(void* arg){                // thread_cache_key destructor, frees made by later destructors register again
+     ThreadCache& cache = *(ThreadCache*)arg;
+     for(int order=0 ; order<=THREAD_CACHE_MAX_ORDER ; ++order){
+          if( cache.count[order] ){
+               thread_cache_flush(order, cache.count[order]);
+          }
+     }
+     pthread_mutex_lock(&heap_lock);
+     thread_cache_unregister(cache);
+     pthread_mutex_unlock(&heap_lock);
+}
+//============== Thread cache related end ==============
+
+//================= Slab related start =================
+struct Slab{                                                    // Lives right after the buddy header of the block it carves
+     Slab*               next;
+     Slab*               prev;
+     uint64_t            free_mask;                             // Bit i set iff object i is free, no per-object header
+     uint64_t            sampled_mask;                          // Bit i set iff object i is in the profiler's sample table
+     uint32_t            object_size;
+     uint8_t             capacity;                              // At most 64
+     uint8_t             node;                                  // Which slab_partial lists it is on
+     uint8_t             size_class;
+     uint8_t             order;
+};
+
+#ifdef MALLOC_INTERPOSE
+const size_t slab_class_size[SLAB_CLASSES]  = {16, 32, 48, 64, 96};
+const int slab_class_order[SLAB_CLASSES]    = {2, 3, 3, 3, 3};  // Each slab holds at most 64 objects (one free_mask)
+#else
+const size_t slab_class_size[SLAB_CLASSES]  = {8, 16, 32, 48, 64, 96};
+const int slab_class_order[SLAB_CLASSES]    = {2, 2, 3, 3, 3, 3};  // Each slab holds at most 64 objects (one free_mask)
+#endif
+
+Slab* slab_partial[NUMA_MAX_NODES][SLAB_CLASSES] = {{nullptr}};  // Slabs that still have a free object, per node and class
+
+size_t slab_count                           = 0;               // Stats for the slab layer, guarded by heap_lock
+size_t slab_buddy_bytes                     = 0;
+size_t slab_slots                           = 0;
+size_t slab_slot_bytes                      = 0;
+size_t slab_free_slots                      = 0;
+size_t slab_free_bytes                      = 0;
+
+int get_slab_class(size_t size){
+     int size_class = 0;
+     while( slab_class_size[size_class] < size ){
+          size_class++;
+     }
+     return size_class;
+}
+
+// Objects are packed from right after the Slab, but none may start FAST_PAYLOAD_OFFSET bytes into a
+// ZERO_ORDER_BLOCK_SIZE line: sfree_fast and find_slab take such a pointer for a buddy payload. The
+// layout of a class is the same in every slab, so it is worked out once into these tables.
+#define SLAB_NO_OBJECT        0xff
+uint16_t slab_layout_offset[SLAB_CLASSES][BITS_PER_WORD];                      // Object i sits this far into its block
+uint8_t  slab_layout_index[SLAB_CLASSES][(ZERO_ORDER_BLOCK_SIZE << SLAB_MAX_ORDER) / SLAB_MIN_SIZE];   // And back, by offset / SLAB_MIN_SIZE
+uint8_t  slab_layout_capacity[SLAB_CLASSES] = {0};                             // 0 until create_slab lays the class out, guarded by heap_lock
+
+void layout_slab_class(int size_class){
+     size_t size       = slab_class_size[size_class];
+     size_t alignment  = std::min(size, (size_t)SLAB_OBJECT_ALIGNMENT);
+     size_t block_size = ZERO_ORDER_BLOCK_SIZE << slab_class_order[size_class];
+     size_t offset     = (sizeof(MallocMetadata) + sizeof(Slab) + alignment - 1) & ~(alignment - 1);
+     std::memset(slab_layout_index[size_class], SLAB_NO_OBJECT, sizeof(slab_layout_index[size_class]));
+     int count = 0;
+     while( count < BITS_PER_WORD && offset + size <= block_size ){         // One free_mask, whatever the geometry
+          if( offset % ZERO_ORDER_BLOCK_SIZE == FAST_PAYLOAD_OFFSET ){
+               offset += alignment;
+               continue;
+          }
+          slab_layout_offset[size_class][count]                 = offset;
+          slab_layout_index[size_class][offset / SLAB_MIN_SIZE] = count;
+          count++;
+          offset += size;
+     }
+     slab_layout_capacity[size_class] = count;
+}
+
+char* slab_block(Slab* slab){
+     return (char*)((MallocMetadata*)slab - 1);
+}
+
+char* slab_object(Slab* slab, size_t object){
+     return slab_block(slab) + slab_layout_offset[slab->size_class][object];
+}
+
+size_t slab_object_index(Slab* slab, void* p){    // SLAB_NO_OBJECT if no object starts at p
+     return slab_layout_index[slab->size_class][((char*)p - slab_block(slab)) / SLAB_MIN_SIZE];
+}
+
+Slab* find_slab(void* p){
+     if( ((uintptr_t)p & (SLAB_MIN_SIZE - 1)) || ((uintptr_t)p & (ZERO_ORDER_BLOCK_SIZE - 1)) == FAST_PAYLOAD_OFFSET ){
+          return nullptr;                                                       // Misaligned, or a buddy payload by its position alone
+     }
+     Arena* arena = heap.arena_of(p);
+     if( !arena ){
+          return nullptr;                                                       // Not a buddy heap pointer, mmap or foreign
+     }
+     size_t offset = (char*)p - arena->base;
+     for(int order=0 ; order<=SLAB_MAX_ORDER ; ++order){                        // The owning slab is found from the address alone
+          size_t index = offset >> (order + DefaultHeap::min_shift);
+          uint64_t bits = __atomic_load_n(&arena->slab_bitmap[DefaultHeap::bitmap_offset(order) + index / BITS_PER_WORD], __ATOMIC_RELAXED);
+          if( (bits >> (index % BITS_PER_WORD)) & 1 ){                         // A live object pins its slab bit, no lock needed
+               return (Slab*)((MallocMetadata*)(arena->base + (index << (order + DefaultHeap::min_shift))) + 1);
+          }
+     }
+     return nullptr;
+}
+
+void unlink_slab(Slab* slab){
+     if( slab -> prev ){
+          slab -> prev -> next          = slab -> next;
+     }
+     else{
+          slab_partial[slab->node][slab->size_class] = slab -> next;
+     }
+     if( slab -> next ){
+          slab -> next -> prev          = slab -> prev;
+     }
+     slab -> next = slab -> prev = nullptr;
+}
+
+void link_slab(Slab* slab){
+     slab -> prev = nullptr;
+     slab -> next = slab_partial[slab->node][slab->size_class];
+     if( slab -> next ){
+          slab -> next -> prev          = slab;
+     }
+     slab_partial[slab->node][slab->size_class] = slab;
+}
+
+Slab* create_slab(int size_class, int node){
+     int order = slab_class_order[size_class];
+     MallocMetadata* block = heap.buddy_allocate(order, node);
+     if( !block ){
+          return nullptr;
+     }
+     if( !slab_layout_capacity[size_class] ){
+          layout_slab_class(size_class);
+     }
+     Slab* slab               = (Slab*)(block + 1);
+     slab -> object_size      = slab_class_size[size_class];
+     slab -> capacity         = slab_layout_capacity[size_class];
+     slab -> free_mask        = (slab->capacity == 64) ? ~(uint64_t)0 : (((uint64_t)1 << slab->capacity) - 1);
+     slab -> sampled_mask     = 0;
+     slab -> node             = node;
+     slab -> size_class       = size_class;
+     slab -> order            = order;
+     link_slab(slab);
+
+     Arena* arena = heap.arena_of(block);
+     size_t index = ((char*)block - arena->base) >> (order + DefaultHeap::min_shift);
+     __atomic_fetch_or(&arena->slab_bitmap[DefaultHeap::bitmap_offset(order) + index / BITS_PER_WORD], ((uint64_t)1 << (index % BITS_PER_WORD)), __ATOMIC_RELAXED);
+
+     slab_count++;
+     slab_buddy_bytes        += block->size - sizeof(MallocMetadata);
+     slab_slots              += slab->capacity;
+     slab_slot_bytes         += slab->capacity * slab->object_size;
+     slab_free_slots         += slab->capacity;
+     slab_free_bytes         += slab->capacity * slab->object_size;
+     return slab;
+}
+
+void destroy_slab(Slab* slab){
+     MallocMetadata* block = ((MallocMetadata*)slab) - 1;
+     unlink_slab(slab);
+
+     Arena* arena = heap.arena_of(block);
+     size_t index = ((char*)block - arena->base) >> (slab->order + DefaultHeap::min_shift);
+     __atomic_fetch_and(&arena->slab_bitmap[DefaultHeap::bitmap_offset(slab->order) + index / BITS_PER_WORD], ~((uint64_t)1 << (index % BITS_PER_WORD)), __ATOMIC_RELAXED);
+
+     slab_count--;
+     slab_buddy_bytes        -= block->size - sizeof(MallocMetadata);
+     slab_slots              -= slab->capacity;
+     slab_slot_bytes         -= slab->capacity * slab->object_size;
+     slab_free_slots         -= slab->capacity;
+     slab_free_bytes         -= slab->capacity * slab->object_size;
+     heap.buddy_free(block);
+}
+
+void* slab_allocate(size_t size, int node){
+     int size_class = get_slab_class(size);
+     Slab* slab = slab_partial[node][size_class];
+     if( !slab && !(slab = create_slab(size_class, node)) ){
+          return nullptr;
+     }
+     int object = __builtin_ctzll(slab->free_mask);                            // Lowest free object first
+     slab -> free_mask &= ~((uint64_t)1 << object);
+     if( !slab->free_mask ){                                                    // Full slabs leave the partial list
+          unlink_slab(slab);
+     }
+     slab_free_slots--;
+     slab_free_bytes         -= slab->object_size;
+     return slab_object(slab, object);
+}
+
+void slab_free(Slab* slab, void* p){
+     size_t object = slab_object_index(slab, p);
+#ifdef MALLOC_HARDENED
+     if( object >= slab->capacity ){                                           // SLAB_NO_OBJECT is never below a capacity
+          heap_corruption("pointer into the middle of a slab object", p);
+     }
+     if( (slab->free_mask >> object) & 1 ){
+          heap_corruption("double free of a slab object", p);
+     }
+#endif
+     if( (slab->free_mask >> object) & 1 ){
+          return;                                                               // Double free, same as is_free for buddy blocks
+     }
+     if( !slab->free_mask ){                                                    // Was full, so it is back in business
+          link_slab(slab);
+     }
+     slab -> free_mask |= ((uint64_t)1 << object);
+     slab_free_slots++;
+     slab_free_bytes         += slab->object_size;
+     uint64_t all = (slab->capacity == 64) ? ~(uint64_t)0 : (((uint64_t)1 << slab->capacity) - 1);
+     if( slab->free_mask == all ){                                              // Empty slab goes back to the buddy heap
+          destroy_slab(slab);
+     }
+}
+
+bool slab_object_sampled(Slab* slab, void* p){    // The division is only paid in slabs that hold a sample
+     uint64_t sampled = __atomic_load_n(&slab->sampled_mask, __ATOMIC_RELAXED);
+     return sampled && ((sampled >> slab_object_index(slab, p)) & 1);
+}
+//================== Slab related end ==================
+
+//============== Mmap cache related start ==============
+struct CachedMapping{                                           // A cached mapping keeps its free time in the dead payload
+     MmapBlock           block;
+     uint64_t            freed_at_ms;
+};
+
+static_assert(MMAP_CACHE_BUCKETS >= 1 && MMAP_CACHE_BUCKETS <= 63 && ((uint64_t)(MMAP_CACHE_BUDGET) >> 12) < ((uint64_t)1 << MMAP_CACHE_BUCKETS),
+              "Every mapping that fits MMAP_CACHE_BUDGET needs a bucket, even with 4 KiB pages");
+
+MmapBlock* mmap_cache_head[MMAP_CACHE_BUCKETS] = {nullptr};    // Newest first, bucket b holds mappings of [2^b, 2^(b+1)) pages
+MmapBlock* mmap_cache_tail[MMAP_CACHE_BUCKETS] = {nullptr};
+size_t mmap_cache_bytes                         = 0;
+
+uint64_t now_ms(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+     return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int mmap_cache_bucket(size_t length){            // -1 past the last bucket, such a mapping is never cached
+     int bucket = 63 - __builtin_clzll(length / page_size);
+     return bucket < MMAP_CACHE_BUCKETS ? bucket : -1;
+}
+
+void mmap_cache_unlink(MmapBlock* block, int bucket){
+     if( block -> prev ){
+          block -> prev -> next         = block -> next;
+     }
+     else{
+          mmap_cache_head[bucket]       = block -> next;
+     }
+     if( block -> next ){
+          block -> next -> prev         = block -> prev;
+     }
+     else{
+          mmap_cache_tail[bucket]       = block -> prev;
+     }
+     mmap_cache_bytes -= block->length;
+}
+
+void mmap_cache_evict(MmapBlock* block, int bucket, MmapBlock** evicted){
+     mmap_cache_unlink(block, bucket);
+     block -> next = *evicted;                                                  // Unmapped by the caller once the lock is dropped
+     *evicted      = block;
+}
+
+void mmap_cache_decay(MmapBlock** evicted){
+     uint64_t now = now_ms();
+     for(int b=0 ; b<MMAP_CACHE_BUCKETS ; ++b){                                 // Oldest sit at the tails
+          while( mmap_cache_tail[b] && now - ((CachedMapping*)mmap_cache_tail[b])->freed_at_ms > MMAP_CACHE_DECAY_MS ){
+               mmap_cache_evict(mmap_cache_tail[b], b, evicted);
+          }
+     }
+}
+
+MmapBlock* mmap_cache_take(size_t length, MmapBlock** evicted){
+     mmap_cache_decay(evicted);
+     int bucket = mmap_cache_bucket(length);
+     if( bucket < 0 ){
+          return nullptr;
+     }
+     for(MmapBlock* block = mmap_cache_head[bucket] ; block ; block = block->next){
+          if( block->length >= length ){                                        // Same bucket, so at most twice the pages
+               mmap_cache_unlink(block, bucket);
+               return block;
+          }
+     }
+     return nullptr;
+}
+
+void mmap_cache_put(MmapBlock* block, MmapBlock** evicted){
+     int bucket = mmap_cache_bucket(block->length);
+     if( block->length > MMAP_CACHE_BUDGET || bucket < 0 ){
+          block -> next = *evicted;
+          *evicted      = block;
+          return;
+     }
+     ((CachedMapping*)block) -> freed_at_ms = now_ms();
+     block -> prev = nullptr;
+     block -> next = mmap_cache_head[bucket];
+     if( block -> next ){
+          block -> next -> prev         = block;
+     }
+     else{
+          mmap_cache_tail[bucket]       = block;
+     }
+     mmap_cache_head[bucket] = block;
+     mmap_cache_bytes += block->length;
+
+     mmap_cache_decay(evicted);
+     while( mmap_cache_bytes > MMAP_CACHE_BUDGET ){                             // Over budget, drop the oldest mapping of any bucket
+          int oldest = -1;
+          for(int b=0 ; b<MMAP_CACHE_BUCKETS ; ++b){
+               if( mmap_cache_tail[b] && (oldest == -1 ||
+                   ((CachedMapping*)mmap_cache_tail[b])->freed_at_ms < ((CachedMapping*)mmap_cache_tail[oldest])->freed_at_ms) ){
+                    oldest = b;
+               }
+          }
+          mmap_cache_evict(mmap_cache_tail[oldest], oldest, evicted);
+     }
+}
+
+void mmap_cache_release(MmapBlock* evicted){
+     while( evicted ){
+          MmapBlock* next = evicted -> next;
+          munmap((void*)evicted, evicted->length);
+          evicted = next;
+     }
+}
+//=============== Mmap cache related end ===============
+
+//=============== Profiler related start ===============
+// Geometric sampling: the gap between two samples is drawn from an exponential distribution with
+// mean PROFILE_SAMPLE_BYTES, so every allocated byte is equally likely to be picked and the fast
+// path is one thread local decrement. A sample keeps its stack, size, block order and birth time
+// until it is freed, then its lifetime is added to the stack's site.
+struct ProfileSite{                                             // One call stack and block kind
+     uint64_t            hash;                                  // 0 marks an empty slot
+     int                 order;                                 // Buddy order, PROFILE_ORDER_MMAP or PROFILE_ORDER_SLAB
+     int                 depth;
+     void*               frames[PROFILE_MAX_DEPTH];             // Innermost first, as backtrace() returns them
+     size_t              samples;                               // Raw sample counts, pprof scales heap_v2 ones itself
+     size_t              sampled_bytes;
+     size_t              live_samples;
+     size_t              live_bytes;
+     double              estimated_bytes[PROFILE_LIFETIMES];    // Unsampled bytes by lifetime, the last bucket is still live
+};
+
+struct ProfileSample{                                           // A sampled allocation that is still live
+     uintptr_t           ptr;                                   // 0 marks an empty slot
+     ProfileSite*        site;
+     MallocMetadata*     header;                                // nullptr for slab objects
+     size_t              size;
+     double              estimated_bytes;
+     uint64_t            born_ns;
+};
+
+#define PROFILE_LIVE_SIZE     (1UL << PROFILE_LIVE_BITS)
+
+ProfileSite profile_sites[PROFILE_MAX_SITES];                   // Both tables are guarded by profile_lock
+ProfileSample profile_live[PROFILE_LIVE_SIZE];
+size_t profile_live_count                = 0;
+size_t profile_dropped                   = 0;               // Samples lost to a full table
+
+thread_local int64_t profile_countdown __attribute__((tls_model("initial-exec"))) = 0;    // Bytes left until this thread samples
+thread_local uint64_t profile_rng __attribute__((tls_model("initial-exec")))      = 0;    // xorshift64* state, 0 until first use
+thread_local bool profile_busy __attribute__((tls_model("initial-exec")))         = false; // backtrace() and dladdr() may allocate
+
+const char* const profile_lifetime_names[PROFILE_LIFETIMES] = {"<10us", "<1ms", "<100ms", ">=100ms", "live"};
+
+uint64_t now_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+int64_t profile_next_gap(){
+     uint64_t x = profile_rng;
+     x ^= x >> 12;
+     x ^= x << 25;
+     x ^= x >> 27;
+     profile_rng = x;
+     double u = ((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);      // Uniform in [0, 1), 53 bits
+     return (int64_t)(-std::log(1.0 - u) * PROFILE_SAMPLE_BYTES) + 1;
+}
+
+int profile_lifetime(uint64_t ns){
+     return (ns < 10000) ? 0 : (ns < 1000000) ? 1 : (ns < 100000000) ? 2 : 3;
+}
+
+size_t profile_slot(uintptr_t ptr){               // Fibonacci hashing, the low bits of pointers are all alike
+     return (size_t)((ptr * 0x9E3779B97F4A7C15ULL) >> (BITS_PER_WORD - PROFILE_LIVE_BITS));
+}
+
+ProfileSite* profile_site(void** frames, int depth, int order){             // Called with profile_lock held
+     uint64_t hash = (uint64_t)(order + 3);
+     for(int i=0 ; i<depth ; ++i){
+          hash = (hash ^ (uintptr_t)frames[i]) * 0x9E3779B97F4A7C15ULL;
+          hash ^= hash >> 29;
+     }
+     hash |= 1;
+     size_t slot = hash % PROFILE_MAX_SITES;
+     for(int probes=0 ; probes<PROFILE_MAX_SITES ; ++probes){
+          ProfileSite* site = &profile_sites[slot];
+          if( !site->hash ){
+               site -> hash    = hash;
+               site -> order   = order;
+               site -> depth   = depth;
+               std::memcpy(site->frames, frames, depth * sizeof(void*));
+               return site;
+          }
+          if( site->hash == hash && site->order == order && site->depth == depth && !std::memcmp(site->frames, frames, depth * sizeof(void*)) ){
+               return site;
+          }
+          slot = (slot + 1) % PROFILE_MAX_SITES;
+     }
+     return nullptr;
+}
+
+ProfileSample* profile_insert(uintptr_t ptr){     // Called with profile_lock held
+     if( profile_live_count >= PROFILE_LIVE_SIZE / 4 * 3 ){
+          return nullptr;                                                       // Fuller than this and the probe chains get long
+     }
+     size_t slot = profile_slot(ptr);
+     while( profile_live[slot].ptr ){
+          slot = (slot + 1) & (PROFILE_LIVE_SIZE - 1);
+     }
+     profile_live[slot].ptr = ptr;
+     profile_live_count++;
+     return &profile_live[slot];
+}
+
+bool profile_remove(uintptr_t ptr, ProfileSample* removed){                 // Backward shift deletion keeps probe chains intact
+     size_t slot = profile_slot(ptr);
+     while( profile_live[slot].ptr != ptr ){
+          if( !profile_live[slot].ptr ){
+               return false;                                                    // profile_insert always leaves an empty slot
+          }
+          slot = (slot + 1) & (PROFILE_LIVE_SIZE - 1);
+     }
+     *removed = profile_live[slot];
+     size_t hole = slot;
+     while( true ){
+          slot = (slot + 1) & (PROFILE_LIVE_SIZE - 1);
+          if( !profile_live[slot].ptr ){
+               break;
+          }
+          size_t home = profile_slot(profile_live[slot].ptr);
+          if( ((slot - home) & (PROFILE_LIVE_SIZE - 1)) >= ((slot - hole) & (PROFILE_LIVE_SIZE - 1)) ){
+               profile_live[hole] = profile_live[slot];
+               hole = slot;
+          }
+     }
+     profile_live[hole].ptr = 0;
+     profile_live_count--;
+     return true;
+}
+
+void profile_sample(void* p, size_t size) __attribute__((noinline, cold));
+
+void profile_sample(void* p, size_t size){
+     bool first = !profile_rng;
+     if( first ){
+          profile_rng = (header_secret ^ (uintptr_t)&profile_rng) | 1;         // Own stream per thread
+     }
+     profile_countdown = profile_next_gap();
+     if( first || !p || profile_busy ){
+          return;                                                               // A thread's first gap starts here
+     }
+     profile_busy = true;
+     void* frames[PROFILE_MAX_DEPTH + 1];
+     int depth = backtrace(frames, PROFILE_MAX_DEPTH + 1) - 1;                  // Minus this frame
+     Slab* slab = find_slab(p);
+     MallocMetadata* header = slab ? nullptr : header_of(p);
+     int order = slab ? PROFILE_ORDER_SLAB : (header->is_mmap ? PROFILE_ORDER_MMAP : (int)header->order);
+     double estimated = size / (1.0 - std::exp(-(double)size / PROFILE_SAMPLE_BYTES));   // What one sample of this size stands for
+     uint64_t born = now_ns();
+
+     pthread_mutex_lock(&profile_lock);
+     ProfileSite* site = profile_site(frames + 1, depth, order);
+     ProfileSample* sample = site ? profile_insert((uintptr_t)p) : nullptr;
+     if( sample ){
+          sample -> site            = site;
+          sample -> header          = header;
+          sample -> size            = size;
+          sample -> estimated_bytes = estimated;
+          sample -> born_ns         = born;
+          site -> samples++;
+          site -> sampled_bytes    += size;
+          site -> live_samples++;
+          site -> live_bytes       += size;
+          site -> estimated_bytes[PROFILE_LIFETIMES - 1] += estimated;
+          if( slab ){
+               __atomic_fetch_or(&slab->sampled_mask, (uint64_t)1 << slab_object_index(slab, p), __ATOMIC_RELAXED);
+          }
+          else{
+               header -> is_sampled = true;                                     // Outside the sealed bits, no reseal
+          }
+     }
+     else{
+          profile_dropped++;
+     }
+     pthread_mutex_unlock(&profile_lock);
+     profile_busy = false;
+}
+
+inline void* profile_account(void* p, size_t size){            // All an unsampled allocation pays
+     if( MALLOC_PROFILE && __builtin_expect((profile_countdown -= (int64_t)size) < 0, 0) ){
+          profile_sample(p, size);
+     }
+     return p;
+}
+
+size_t profile_account_batch(void** ptrs, size_t count, size_t size){
+     for(size_t i=0 ; i<count ; ++i){
+          profile_account(ptrs[i], size);
+     }
+     return count;
+}
+
+void profile_release(void* p){                    // Before the block is freed or resized, the header and slab must still be there
+     uint64_t now = now_ns();
+     ProfileSample sample;
+     pthread_mutex_lock(&profile_lock);
+     if( profile_remove((uintptr_t)p, &sample) ){
+          ProfileSite* site = sample.site;
+          site -> live_samples--;
+          site -> live_bytes -= sample.size;
+          site -> estimated_bytes[PROFILE_LIFETIMES - 1]                   -= sample.estimated_bytes;
+          site -> estimated_bytes[profile_lifetime(now - sample.born_ns)] += sample.estimated_bytes;
+          if( sample.header ){
+               sample.header -> is_sampled = false;
+          }
+          else{
+               Slab* slab = find_slab(p);
+               __atomic_fetch_and(&slab->sampled_mask, ~((uint64_t)1 << slab_object_index(slab, p)), __ATOMIC_RELAXED);
+          }
+     }
+     pthread_mutex_unlock(&profile_lock);
+}
+
+struct ProfileWriter{                             // Dumps go straight to the fd, stdio would allocate
+     int                 fd;
+     size_t              used;
+     char                buffer[4096];
+};
+
+void profile_flush(ProfileWriter* writer){
+     size_t done = 0;
+     while( done < writer->used ){
+          ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+          if( written <= 0 ){
+               break;                                                           // Nothing sensible to do from in here
+          }
+          done += written;
+     }
+     writer -> used = 0;
+}
+
+void profile_printf(ProfileWriter* writer, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void profile_printf(ProfileWriter* writer, const char* format, ...){
+     for(int attempt=0 ; attempt<2 ; ++attempt){
+          va_list args;
+          va_start(args, format);
+          size_t room = sizeof(writer->buffer) - writer->used;
+          int length = vsnprintf(writer->buffer + writer->used, room, format, args);
+          va_end(args);
+          if( length >= 0 && (size_t)length < room ){
+               writer -> used += length;
+               return;
+          }
+          profile_flush(writer);                                                // Retry once in an empty buffer, then truncate
+     }
+     writer -> used = sizeof(writer->buffer) - 1;
+}
+
+void profile_print_frame(ProfileWriter* writer, void* frame){
+     Dl_info info;
+     void* call = (char*)frame - 1;                                             // A return address may already be past its function
+     bool found = dladdr(call, &info);                                          // info is only filled in when it succeeds
+     if( found && info.dli_sname ){
+          profile_printf(writer, "%s", info.dli_sname);
+     }
+     else if( found && info.dli_fname ){                                        // Static symbols, feed module+offset to addr2line
+          const char* module = strrchr(info.dli_fname, '/');
+          profile_printf(writer, "%s+0x%lx", module ? module + 1 : info.dli_fname, (unsigned long)((char*)call - (char*)info.dli_fbase));
+     }
+     else{
+          profile_printf(writer, "0x%lx", (unsigned long)(uintptr_t)call);
+     }
+}
+
+void profile_dump_collapsed(ProfileWriter* writer, ProfileSite* site){       // Root first, then the block kind and lifetime as leaves
+     for(int bucket=0 ; bucket<PROFILE_LIFETIMES ; ++bucket){
+          if( site->estimated_bytes[bucket] < 0.5 ){
+               continue;
+          }
+          for(int i=site->depth - 1 ; i>=0 ; --i){
+               profile_print_frame(writer, site->frames[i]);
+               profile_printf(writer, ";");
+          }
+          if( site->order == PROFILE_ORDER_MMAP ){
+               profile_printf(writer, "[mmap]");
+          }
+          else if( site->order == PROFILE_ORDER_SLAB ){
+               profile_printf(writer, "[slab]");
+          }
+          else{
+               profile_printf(writer, "[order %d]", site->order);
+          }
+          profile_printf(writer, ";[%s] %.0f\n", profile_lifetime_names[bucket], site->estimated_bytes[bucket]);
+     }
+}
+
+void profile_dump_pprof(ProfileWriter* writer, ProfileSite* site){           // Leaf first, pprof symbolizes against MAPPED_LIBRARIES
+     profile_printf(writer, "%zu: %zu [%zu: %zu] @", site->live_samples, site->live_bytes, site->samples, site->sampled_bytes);
+     for(int i=0 ; i<site->depth ; ++i){
+          profile_printf(writer, " 0x%lx", (unsigned long)(uintptr_t)site->frames[i]);
+     }
+     profile_printf(writer, "\n");
+}
+
+size_t sprofile_dump(int fd, int format){         // Returns the number of sites written, safe to call at any time
+
+     pthread_once(&heap_once, initial_allocator);
+
+     ProfileWriter writer;
+     writer.fd   = fd;
+     writer.used = 0;
+     size_t sites = 0;
+     bool was_busy = profile_busy;
+     profile_busy = true;                                                       // dladdr() must not sample into the locked tables
+     pthread_mutex_lock(&profile_lock);
+     if( format == PROFILE_DUMP_PPROF ){
+          size_t live_samples = 0, live_bytes = 0, samples = 0, sampled_bytes = 0;
+          for(int i=0 ; i<PROFILE_MAX_SITES ; ++i){
+               live_samples  += profile_sites[i].live_samples;
+               live_bytes    += profile_sites[i].live_bytes;
+               samples       += profile_sites[i].samples;
+               sampled_bytes += profile_sites[i].sampled_bytes;
+          }
+          profile_printf(&writer, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_samples, live_bytes, samples, sampled_bytes, (size_t)PROFILE_SAMPLE_BYTES);
+     }
+     for(int i=0 ; i<PROFILE_MAX_SITES ; ++i){
+          if( !profile_sites[i].hash ){
+               continue;
+          }
+          if( format == PROFILE_DUMP_PPROF ){
+               profile_dump_pprof(&writer, &profile_sites[i]);
+          }
+          else{
+               profile_dump_collapsed(&writer, &profile_sites[i]);
+          }
+          sites++;
+     }
+     pthread_mutex_unlock(&profile_lock);
+     if( format == PROFILE_DUMP_PPROF ){
+          profile_printf(&writer, "\nMAPPED_LIBRARIES:\n");
+          profile_flush(&writer);
+          int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+          ssize_t length;
+          while( maps >= 0 && (length = read(maps, writer.buffer, sizeof(writer.buffer))) > 0 ){
+               writer.used = length;
+               profile_flush(&writer);
+          }
+          if( maps >= 0 ){
+               close(maps);
+          }
+     }
+     profile_flush(&writer);
+     profile_busy = was_busy;
+     return sites;
+}
+//================ Profiler related end ================
+
+//=============== Telemetry related start ==============
+// A JSON view of the heap for collectors that poll: the stats snapshot per order, how fragmented the
+// free buddy space is, the mmap side, split/merge counts and, with MALLOC_TELEMETRY, smalloc/sfree
+// latency histograms. Each thread times one call in TELEMETRY_SAMPLE_EVERY with the TSC, buckets are
+// powers of two of ticks. stelemetry_signal() makes a signal trigger a dump, so a running process is
+// scraped with kill and no debugger. The handler only posts a semaphore, a helper thread takes the
+// locks and writes.
+uint64_t telemetry_latency[2][TELEMETRY_BUCKETS];               // [0] smalloc, [1] sfree, relaxed atomic increments
+uint64_t telemetry_start_ticks                 = 0;         // Set once in initial_allocator, dumps derive ticks_per_ns
+uint64_t telemetry_start_ns                    = 0;
+int telemetry_fd                               = -1;        // Where signalled dumps go, unless telemetry_path is set
+sem_t telemetry_wakeup;                                     // Posted by the signal handler, sem_post is async signal safe
+bool telemetry_thread_running                  = false;     // Guarded by heap_lock, a forked child has no helper
+char telemetry_path[TELEMETRY_PATH_MAX];
+char telemetry_temp_path[TELEMETRY_PATH_MAX];               // The dump lands here first and is renamed over telemetry_path
+
+thread_local int telemetry_countdown __attribute__((tls_model("initial-exec"))) = 0;    // Calls left until this thread times one
+
+const char* const telemetry_call_names[2] = {"smalloc", "sfree"};
+
+inline uint64_t telemetry_ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+     return __builtin_ia32_rdtsc();               // Not serializing, a sample may be off by a few dozen ticks
+#else
+     return now_ns();
+#endif
+}
+
+void telemetry_start(){                           // From initial_allocator
+     telemetry_start_ticks = telemetry_ticks();
+     telemetry_start_ns    = now_ns();
+}
+
+void telemetry_record(int call, uint64_t ticks){
+     int bucket = std::min(TELEMETRY_BUCKETS - 1, BITS_PER_WORD - __builtin_clzll(ticks | 1));   // ticks < 2^bucket
+     __atomic_fetch_add(&telemetry_latency[call][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void telemetry_write(int fd){
+     ProfileWriter writer;
+     writer.fd   = fd;
+     writer.used = 0;
+
+     MallocStats stats;
+     size_t cached_blocks, cached_bytes;
+     pthread_mutex_lock(&heap_lock);
+     snapshot_stats_locked(&stats);
+     thread_cache_totals(&cached_blocks, &cached_bytes);
+     size_t cached_mmap_bytes = mmap_cache_bytes;
+     pthread_mutex_unlock(&heap_lock);
+
+     profile_printf(&writer, "{\"heap\": {\"arenas\": %zu, \"free_blocks\": %zu, \"free_bytes\": %zu, \"allocated_blocks\": %zu, "
+                    "\"allocated_bytes\": %zu, \"meta_data_bytes\": %zu, \"dirty_bytes\": %zu, \"purged_bytes\": %zu, "
+                    "\"quick_blocks\": %zu, \"thread_cache_blocks\": %zu, \"thread_cache_bytes\": %zu}",
+                    stats.arenas, stats.free_blocks, stats.free_bytes, stats.allocated_blocks, stats.allocated_bytes,
+                    stats.meta_data_bytes, stats.dirty_bytes, stats.purged_bytes, stats.quick_blocks, cached_blocks, cached_bytes);
+     profile_printf(&writer, ",\n \"orders\": [");
+     size_t free_buddy_bytes = 0;
+     int largest_free_order = -1;
+     for(int i=0 ; i<=MAX_ORDER ; ++i){
+          size_t block_size = (size_t)ZERO_ORDER_BLOCK_SIZE << i;
+          profile_printf(&writer, "%s\n  {\"order\": %d, \"block_bytes\": %zu, \"free\": %zu, \"used\": %zu}", i ? "," : "",
+                         i, block_size, stats.free_per_order[i], stats.used_per_order[i]);
+          free_buddy_bytes += stats.free_per_order[i] * block_size;
+          largest_free_order = stats.free_per_order[i] ? i : largest_free_order;
+     }
+     size_t largest_free_bytes = (largest_free_order < 0) ? 0 : (size_t)ZERO_ORDER_BLOCK_SIZE << largest_free_order;
+     profile_printf(&writer, "],\n \"fragmentation\": {\"free_buddy_bytes\": %zu, \"largest_free_order\": %d, "
+                    "\"largest_free_bytes\": %zu, \"external\": %.4f}",                   // 0 only when one block holds all free bytes
+                    free_buddy_bytes, largest_free_order, largest_free_bytes,
+                    free_buddy_bytes ? 1.0 - (double)largest_free_bytes / free_buddy_bytes : 0.0);
+     profile_printf(&writer, ",\n \"mmap\": {\"blocks\": %zu, \"bytes\": %zu, \"cached_bytes\": %zu}",
+                    stats.mmap_blocks, stats.mmap_bytes, cached_mmap_bytes);
+     profile_printf(&writer, ",\n \"splits\": %zu, \"merges\": %zu", stats.splits, stats.merges);
+
+     uint64_t elapsed_ns = now_ns() - telemetry_start_ns;
+     profile_printf(&writer, ",\n \"latency\": {\"enabled\": %s, \"sample_every\": %d, \"ticks_per_ns\": %.4f, "
+                    "\"bucket\": \"b counts samples below 2^b ticks\"",
+                    MALLOC_TELEMETRY ? "true" : "false", TELEMETRY_SAMPLE_EVERY,
+                    elapsed_ns ? (double)(telemetry_ticks() - telemetry_start_ticks) / elapsed_ns : 0.0);
+     for(int call=0 ; call<2 ; ++call){
+          profile_printf(&writer, ",\n  \"%s\": [", telemetry_call_names[call]);
+          for(int b=0 ; b<TELEMETRY_BUCKETS ; ++b){
+               profile_printf(&writer, "%s%lu", b ? ", " : "", (unsigned long)__atomic_load_n(&telemetry_latency[call][b], __ATOMIC_RELAXED));
+          }
+          profile_printf(&writer, "]");
+     }
+     profile_printf(&writer, "}}\n");
+     profile_flush(&writer);
+}
+
+void stelemetry_dump(int fd){                     // Writes one JSON object, blocks on heap_lock like the stats do
+     pthread_once(&heap_once, initial_allocator);
+     telemetry_write(fd);
+}
+
+void telemetry_signal_handler(int){               // Nothing but the post, the dump needs locks and stdio formatting
+     int saved_errno = errno;
+     sem_post(&telemetry_wakeup);
+     errno = saved_errno;
+}
+
+void* telemetry_thread(void*){
+     sigset_t all;
+     sigfillset(&all);
+     pthread_sigmask(SIG_BLOCK, &all, nullptr);   // The program's signals go to the program's threads
+     while( true ){
+          if( sem_wait(&telemetry_wakeup) ){
+               continue;                          // EINTR
+          }
+          char path[TELEMETRY_PATH_MAX], temp_path[TELEMETRY_PATH_MAX];
+          pthread_mutex_lock(&heap_lock);         // stelemetry_signal() may be changing them
+          std::memcpy(path, telemetry_path, sizeof(path));
+          std::memcpy(temp_path, telemetry_temp_path, sizeof(temp_path));
+          int fd = telemetry_fd;
+          pthread_mutex_unlock(&heap_lock);
+          if( path[0] ){                          // Readers see the previous dump or this one, never half of it
+               int file = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+               if( file >= 0 ){
+                    telemetry_write(file);
+                    close(file);
+                    rename(temp_path, path);
+               }
+          }
+          else if( fd >= 0 ){
+               telemetry_write(fd);
+          }
+     }
+     return nullptr;
+}
+
+void telemetry_after_fork(){                      // From fork_child, the helper thread stayed in the parent
+     telemetry_thread_running = false;
+}
+
+int stelemetry_signal(int signo, int fd, const char* path){    // Dumps go to path when given (replaced each time), else to fd, -1 and errno on failure
+     pthread_once(&heap_once, initial_allocator);
+     if( path && strlen(path) + sizeof(".tmp") > TELEMETRY_PATH_MAX ){
+          errno = ENAMETOOLONG;
+          return -1;
+     }
+     struct sigaction action;
+     if( sigaction(signo, nullptr, &action) ){
+          return -1;
+     }
+     if( action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN && action.sa_handler != telemetry_signal_handler ){
+          errno = EBUSY;                          // The program handles this signal itself
+          return -1;
+     }
+
+     pthread_mutex_lock(&heap_lock);
+     telemetry_fd = fd;
+     telemetry_path[0] = '\0';
+     if( path ){
+          snprintf(telemetry_temp_path, TELEMETRY_PATH_MAX, "%s.tmp", path);
+          snprintf(telemetry_path, TELEMETRY_PATH_MAX, "%s", path);
+     }
+     bool start = !telemetry_thread_running;
+     telemetry_thread_running = true;
+     pthread_mutex_unlock(&heap_lock);
+     if( start ){                                 // pthread_create allocates, so not under heap_lock
+          pthread_t thread;
+          pthread_attr_t attributes;
+          sem_init(&telemetry_wakeup, 0, 0);
+          pthread_attr_init(&attributes);
+          pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+          int error = pthread_create(&thread, &attributes, telemetry_thread, nullptr);
+          pthread_attr_destroy(&attributes);
+          if( error ){
+               pthread_mutex_lock(&heap_lock);
+               telemetry_thread_running = false;
+               pthread_mutex_unlock(&heap_lock);
+               errno = error;
+               return -1;
+          }
+     }
+
+     std::memset(&action, 0, sizeof(action));
+     action.sa_handler = telemetry_signal_handler;
+     action.sa_flags   = SA_RESTART;
+     sigemptyset(&action.sa_mask);
+     return sigaction(signo, &action, nullptr);
+}
+//================ Telemetry related end ===============
+
+//=========== malloc_3 implemintations start ===========
+MmapBlock* mmap_block_of(MallocMetadata* header){
+     return (MmapBlock*)((char*)header - offsetof(MmapBlock, header));
+}
+
+size_t round_to_page(size_t length){
+     return (length + page_size - 1) & ~(page_size - 1);
+}
+
+void zero_block(void* p, size_t size){
+#ifdef __SSE2__
+     if( size >= NT_ZERO_THRESHOLD ){             // Streaming stores skip the cache, the block is not read back soon
+          char* start   = (char*)p;
+          char* end     = start + size;
+          char* aligned = (char*)(((uintptr_t)start + 15) & ~(uintptr_t)15);
+          std::memset(start, 0, aligned - start);
+          __m128i zero  = _mm_setzero_si128();
+          for( ; aligned + 64 <= end ; aligned += 64 ){
+               _mm_stream_si128((__m128i*)aligned, zero);
+               _mm_stream_si128((__m128i*)(aligned + 16), zero);
+               _mm_stream_si128((__m128i*)(aligned + 32), zero);
+               _mm_stream_si128((__m128i*)(aligned + 48), zero);
+          }
+          _mm_sfence();
+          std::memset(aligned, 0, end - aligned);
+          return;
+     }
+#endif
+     std::memset(p, 0, size);
+}
+
+void link_mmap_block(MmapBlock* block){            // Callers hold heap_lock
+     block -> prev            = nullptr;
+     block -> next            = mmap_list;
+     if(mmap_list){
+          mmap_list->prev     = block;
+     }
+     mmap_list                = block;
+     mmap_blocks++;
+     mmap_bytes              += block->header.size - sizeof(MallocMetadata);
+}
+
+void unlink_mmap_block(MmapBlock* block){          // Callers hold heap_lock
+     if(block->prev){
+          (block->prev)->next      = block->next;
+     }
+     else{
+          mmap_list                = block -> next;
+     }
+     if(block->next){
+          (block->next)->prev      = block ->prev;
+     }
+     mmap_blocks--;
+     mmap_bytes              -= block->header.size - sizeof(MallocMetadata);
+}
+
+void* allocate_mmap_block(size_t size, bool zero){
+     size_t length = round_to_page(size + sizeof(MmapBlock));
+     MmapBlock* evicted = nullptr;
+     pthread_mutex_lock(&heap_lock);
+     MmapBlock* block = mmap_cache_take(length, &evicted);     // A recently freed mapping saves the mmap and the page faults
+     pthread_mutex_unlock(&heap_lock);
+     mmap_cache_release(evicted);
+
+     if( !block ){
+          void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if( addr == MAP_FAILED ){ return nullptr; }  // mmap failed
+          block                         = (MmapBlock*)addr;
+          block -> length               = length;
+          block -> header.is_zero       = true;        // Fresh pages, the kernel zeroed them
+     }
+     else if( zero ){                                  // Only the header page survived free_mmap_block's madvise
+          char* payload = (char*)(&block->header + 1);
+          size_t dirty  = (MMAP_CACHE_ADVICE == MADV_DONTNEED) ? std::min(size, (size_t)((char*)block + page_size - payload)) : size;
+          zero_block(payload, dirty);
+          block -> header.is_zero       = true;
+     }
+     else{
+          block -> header.is_zero       = false;
+     }
+     block -> header.size               = size + sizeof(MallocMetadata);
+     block -> header.is_free            = false;
+     block -> header.is_mmap            = true;
+     block -> header.is_aligned         = false;
+     block -> header.is_purged          = false;
+     block -> header.is_sampled         = false;
+     block -> header.order              = -1;
+     seal_header(&block->header);
+
+     pthread_mutex_lock(&heap_lock);                   // Only the list linking needs the lock, the syscall does not
+     link_mmap_block(block);
+     pthread_mutex_unlock(&heap_lock);
+
+     return (void*)(&block->header + 1);
+}
+
+void free_mmap_block(MallocMetadata* header){
+     MmapBlock* block = mmap_block_of(header);
+     if( block->length > page_size ){                  // Keep the header page, let the kernel drop the rest
+          madvise((char*)block + page_size, block->length - page_size, MMAP_CACHE_ADVICE);
+     }
+     MmapBlock* evicted = nullptr;
+     pthread_mutex_lock(&heap_lock);
+     unlink_mmap_block(block);
+     mmap_cache_put(block, &evicted);
+     pthread_mutex_unlock(&heap_lock);
+     mmap_cache_release(evicted);
+}
+
+void* resize_mmap_block(MallocMetadata* header, size_t size){
+     MmapBlock* block = mmap_block_of(header);
+     size_t length = round_to_page(size + sizeof(MmapBlock));
+     if( length < block->length ){                     // Shrink, release the tail pages in place
+          munmap((char*)block + length, block->length - length);
+          block -> length = length;
+     }
+     else if( length > block->length ){                // Grow, the kernel moves the pages instead of copying them
+          pthread_mutex_lock(&heap_lock);              // The mapping may move, so it leaves mmap_list while mremap runs unlocked
+          unlink_mmap_block(block);
+          pthread_mutex_unlock(&heap_lock);
+          void* moved = mremap((void*)block, block->length, length, MREMAP_MAYMOVE);
+          if( moved == MAP_FAILED ){
+               pthread_mutex_lock(&heap_lock);
+               link_mmap_block(block);                 // Still the old mapping, untouched
+               pthread_mutex_unlock(&heap_lock);
+               return nullptr;
+          }
+          block = (MmapBlock*)moved;
+          block -> length      = length;
+          block -> header.size = size + sizeof(MallocMetadata);
+          seal_header(&block->header);
+          pthread_mutex_lock(&heap_lock);
+          link_mmap_block(block);
+          pthread_mutex_unlock(&heap_lock);
+          return (void*)(&block->header + 1);
+     }
+     pthread_mutex_lock(&heap_lock);
+     mmap_bytes              += size - (block->header.size - sizeof(MallocMetadata));
+     pthread_mutex_unlock(&heap_lock);
+     block -> header.size = size + sizeof(MallocMetadata);   // Same page count means it fits the slack, no syscall at all
+     seal_header(&block->header);
+     return (void*)(&block->header + 1);
+}
+
+void report_heap_problem(const char* what, const void* where){                 // No stdio buffers, the heap itself may be what is broken
+     char line[160];
+     int length = snprintf(line, sizeof(line), "malloc_3: %s at %p\n", what, where);
+     if( write(STDERR_FILENO, line, std::min(length, (int)sizeof(line) - 1)) < 0 ){
+          return;
+     }
+}
+
+void heap_corruption(const char* what, const void* where){
+     report_heap_problem(what, where);
+     abort();
+}
+
+uint64_t header_check(const MallocMetadata* header){
+     uint64_t word;
+     std::memcpy(&word, header, sizeof(word));
+     word &= HEADER_CHECKED_BITS;                                               // is_zero and is_purged change under a live block, so they are left out
+     word = (word ^ (uintptr_t)header ^ header_secret) * 0x9E3779B97F4A7C15ULL;   // The address keeps a header copied elsewhere from passing
+     return word >> (BITS_PER_WORD - 8);
+}
+
+void seal_header(MallocMetadata* header){          // After the last write to a header handed to the user
+#ifdef MALLOC_HARDENED
+     header -> check = header_check(header);
+#else
+     (void)header;
+#endif
+}
+
+bool header_sealed(const MallocMetadata* header){
+#ifdef MALLOC_HARDENED
+     return header->check == header_check(header);
+#else
+     (void)header;
+     return true;
+#endif
+}
+
+void validate_header(void* p, MallocMetadata* header){                         // Buddy headers are checked against their arena, mmap ones against mmap_list
+     if( header->is_free ){
+          heap_corruption("double free or use after free", p);
+     }
+     if( !header_sealed(header) ){
+          heap_corruption("corrupted block header (overflow, or not our pointer)", p);
+     }
+     if( header->is_mmap ){
+          MmapBlock* block = (MmapBlock*)((char*)header - offsetof(MmapBlock, header));
+          bool linked = ((uintptr_t)block & (page_size - 1)) == 0 && header->order == -1;
+          pthread_mutex_lock(&heap_lock);
+          linked = linked && (block->prev ? block->prev->next == block : mmap_list == block) && (!block->next || block->next->prev == block);
+          pthread_mutex_unlock(&heap_lock);
+          if( !linked || header->size > block->length ){
+               heap_corruption("mmap block is not on mmap_list", p);
+          }
+          return;
+     }
+     Arena* arena = heap.arena_of(header);
+     size_t offset = arena ? (size_t)((char*)header - arena->base) : 0;
+     if( !arena || header->order < 0 || header->order > MAX_ORDER || header->size != (DefaultHeap::min_block << header->order) || (offset & (header->size - 1)) ){
+          heap_corruption("pointer is not a live buddy block", p);
+     }
+}
+
+MallocMetadata* header_of(void* p){
+     MallocMetadata* header = ((MallocMetadata*)p) - 1;
+#ifdef MALLOC_HARDENED
+     if( (uintptr_t)p & (sizeof(MallocMetadata) - 1) ){
+          heap_corruption("misaligned pointer", p);
+     }
+     if( header->is_aligned ){
+          if( header->is_free || !header_sealed(header) ){
+               heap_corruption("corrupted aligned alias header", p);
+          }
+          header = (MallocMetadata*)((char*)header - header->size);
+     }
+     validate_header(p, header);
+     return header;
+#else
+     if( header->is_aligned ){                                                  // Aligned payloads lead back to the real block header
+          header = (MallocMetadata*)((char*)header - header->size);
+     }
+     return header;
+#endif
+}
+
+void* place_aligned(MallocMetadata* block, size_t alignment){
+     char* payload = (char*)(block + 1);
+     char* aligned = (char*)(((uintptr_t)payload + alignment - 1) & ~(alignment - 1));
+     if( aligned != payload ){                                                  // The alias header sits right ahead of the aligned payload
+          MallocMetadata* alias    = ((MallocMetadata*)aligned) - 1;
+          alias -> size            = (char*)alias - (char*)block;
+          alias -> order           = 0;
+          alias -> is_free         = false;
+          alias -> is_mmap         = false;
+          alias -> is_aligned      = true;
+          alias -> is_zero         = false;
+          alias -> is_purged       = false;
+          alias -> is_sampled      = false;
+          seal_header(alias);
+     }
+     block -> is_sampled = false;
+     seal_header(block);
+     return aligned;
+}
+
+bool numa_remote(MallocMetadata* block){          // Remote blocks skip the thread cache and go home to their arena
+     return NUMA_ARENAS == 1 && heap.arena_of(block)->node != numa_current_node();
+}
+
+void* hand_out(MallocMetadata* block){            // Every buddy block leaves through here, sealed
+     if( !block ){
+          return nullptr;
+     }
+     block -> is_sampled = false;
+     seal_header(block);
+     return (void*)(block + 1);
+}
+
+void* smalloc_slow(size_t size){                 // Everything but a thread cache hit: init, slabs, mmap, refills and splits
+
+     pthread_once(&heap_once, initial_allocator);
+
+     if(size == ZERO_SIZE_MALLOC_REQ){            // Bullet a. (size is 0)
+          return NULL;
+     }
+     if(size > MAX_SIZE_MALLOC_REQ){              // Bullet b. (size is bigger than 10^8)
+          return NULL;
+     }
+
+     int node = numa_current_node();
+     if( size <= SLAB_MAX_SIZE ){                 // Small objects share a slab instead of taking a whole block
+          pthread_mutex_lock(&heap_lock);
+          void* object = slab_allocate(size, node);
+          pthread_mutex_unlock(&heap_lock);
+          return profile_account(object, size);
+     }
+     if( size + sizeof(MallocMetadata) >= DefaultHeap::mmap_threshold ){  // Challenge 3 mmap() usage for >= 128kb
+          return profile_account(allocate_mmap_block(size, false), size);
+     }
+     int target_order = DefaultHeap::get_order_from_size(size);
+     if( target_order == -1 ){ return nullptr; }  // Case of size too big
+
+     if( THREAD_CACHE && target_order <= THREAD_CACHE_MAX_ORDER ){
+          MallocMetadata* cached = thread_cache_pop(target_order);
+          return profile_account(hand_out(cached), size);
+     }
+
+     pthread_mutex_lock(&heap_lock);
+     MallocMetadata* block = heap.buddy_allocate(target_order, node);
+     pthread_mutex_unlock(&heap_lock);
+
+     return profile_account(hand_out(block), size);
+}
+
+inline __attribute__((always_inline)) MallocMetadata* thread_cache_take(int order){   // thread_cache_pop without the refill
+     ThreadCache& cache = thread_cache;
+     int count = cache.count[order];
+     if( __builtin_expect(count != 0, 1) ){                                    // A filled magazine also means initial_allocator ran
+          MallocMetadata* block = cache.blocks[order][count - 1];
+          set_cached(cache, order, count - 1);
+          block -> is_free = false;
+          return block;
+     }
+     return nullptr;
+}
+
+inline __attribute__((always_inline)) void* smalloc_fast(size_t size){   // A thread cache hit, no lock, loop or call
+     if( THREAD_CACHE && size - (SLAB_MAX_SIZE + 1) < THREAD_CACHE_MAX_SIZE - SLAB_MAX_SIZE ){   // One compare rules out 0, slab and bigger sizes
+          MallocMetadata* block = thread_cache_take(DefaultHeap::get_order_from_size(size));
+          if( block ){
+               return profile_account(hand_out(block), size);
+          }
+     }
+     return smalloc_slow(size);
+}
+
+void* telemetry_smalloc(size_t size) __attribute__((noinline));
+
+void* telemetry_smalloc(size_t size){            // The timed call, off the path the other calls take
+     telemetry_countdown = TELEMETRY_SAMPLE_EVERY;
+     uint64_t start = telemetry_ticks();
+     void* p = smalloc_fast(size);
+     telemetry_record(0, telemetry_ticks() - start);
+     return p;
+}
+
+void* smalloc(size_t size){
+     if( MALLOC_TELEMETRY && __builtin_expect(--telemetry_countdown < 0, 0) ){
+          return telemetry_smalloc(size);
+     }
+     return smalloc_fast(size);
+}
+
+void clear_payload(MallocMetadata* block, void* p, size_t size){
+     if( block->is_zero ){                        // Clean block, only the free list links were ever written
+          char* links_end = (char*)block + sizeof(FreeBlock);
+          if( (char*)p < links_end ){
+               std::memset(p, 0, std::min(size, (size_t)(links_end - (char*)p)));
+          }
+          block -> is_zero = false;               // It is the caller's now
+          return;
+     }
+     zero_block(p, size);
+}
+
+void* scalloc(size_t num, size_t size){
+
+     if(num == ZERO_SIZE_MALLOC_REQ || size == ZERO_SIZE_MALLOC_REQ){           // Bullet a. (size is 0)
+          return NULL;
+     }
+     if(num > MAX_SIZE_MALLOC_REQ / size){                                      // Bullet b. (size is bigger than 10^8), no num*size overflow
+          return NULL;
+     }
+     size_t total_size = num*size;
+
+     pthread_once(&heap_once, initial_allocator);
+     if( total_size + sizeof(MallocMetadata) >= DefaultHeap::mmap_threshold ){
+          return profile_account(allocate_mmap_block(total_size, true), total_size);   // Fresh or purged pages, no full memset
+     }
+     void* new_block = smalloc(total_size);
+     if(!new_block){
+          return NULL;
+     }
+     if( total_size <= SLAB_MAX_SIZE ){
+          std::memset(new_block, 0, total_size);  // Slab objects have no header of their own
+          return new_block;
+     }
+     clear_payload(((MallocMetadata*)new_block) - 1, new_block, total_size);
+     return new_block;
+}
+
+void sfree_slow(void* p){                        // Everything but a push on a thread cache with room
+
+     if(p == NULL){
+          return;                  // Second bullet
+     }
+     Slab* slab = find_slab(p);
+     if( slab ){                                  // Slab objects have no header to read
+          if( MALLOC_PROFILE && slab_object_sampled(slab, p) ){
+               profile_release(p);
+          }
+          pthread_mutex_lock(&heap_lock);
+          slab_free(slab, p);
+          pthread_mutex_unlock(&heap_lock);
+          return;
+     }
+     MallocMetadata* block_Metadata = header_of(p);
+     if(block_Metadata -> is_free) {
+          return;
+     }
+     if( MALLOC_PROFILE && block_Metadata->is_sampled ){
+          profile_release(p);
+     }
+     if(block_Metadata->is_mmap){
+          free_mmap_block(block_Metadata);
+          return;
+     }
+     if( THREAD_CACHE && block_Metadata->order <= THREAD_CACHE_MAX_ORDER && !numa_remote(block_Metadata) ){
+          thread_cache_push(block_Metadata);      // May come from any thread, the block just joins this thread's magazine
+          return;
+     }
+     pthread_mutex_lock(&heap_lock);
+     heap.buddy_free(block_Metadata);
+     pthread_mutex_unlock(&heap_lock);
+}
+
+inline __attribute__((always_inline)) void sfree_fast(void* p){
+#ifndef MALLOC_HARDENED                           // Hardened builds validate every header in sfree_slow
+     if( THREAD_CACHE && NUMA_ARENAS != 1 && ((uintptr_t)p & (ZERO_ORDER_BLOCK_SIZE - 1)) == FAST_PAYLOAD_OFFSET ){   // Not NULL, a slab object, an mmap or other aligned payload
+          MallocMetadata* block = (MallocMetadata*)((char*)p - FAST_PAYLOAD_OFFSET);
+          MallocMetadata* alias = ((MallocMetadata*)p) - 1;
+          if( FAST_PAYLOAD_OFFSET != sizeof(MallocMetadata) && (!alias->is_aligned || alias->size != (size_t)((char*)alias - (char*)block)) ){
+               sfree_slow(p);                                                   // Only malloc's alias sits right there
+               return;
+          }
+          ThreadCache& cache = thread_cache;
+          uint64_t order = block -> order;                                      // Unsigned, so an mmap order of -1 fails the check too
+          if( order <= THREAD_CACHE_MAX_ORDER && !block->is_free && !block->is_sampled && cache.registered ){
+               int count = cache.count[order];
+               if( __builtin_expect(count != THREAD_CACHE_CAPACITY, 1) ){
+                    block -> is_free = true;
+                    block -> is_zero = false;
+                    cache.blocks[order][count] = block;
+                    set_cached(cache, order, count + 1);
+                    return;
+               }
+          }
+     }
+#endif
+     sfree_slow(p);
+}
+
+void telemetry_sfree(void* p) __attribute__((noinline));
+
+void telemetry_sfree(void* p){
+     telemetry_countdown = TELEMETRY_SAMPLE_EVERY;
+     uint64_t start = telemetry_ticks();
+     sfree_fast(p);
+     telemetry_record(1, telemetry_ticks() - start);
+}
+
+void sfree(void* p){
+     if( MALLOC_TELEMETRY && p && __builtin_expect(--telemetry_countdown < 0, 0) ){
+          telemetry_sfree(p);                     // sfree(NULL) is not worth a sample
+          return;
+     }
+     sfree_fast(p);
+}
+
+void* srealloc(void* oldp, size_t size){
+
+     if(size == ZERO_SIZE_MALLOC_REQ){            // Bullet a. (size is 0)
+          return NULL;
+     }
+     if(size > MAX_SIZE_MALLOC_REQ){              // Bullet b. (size is bigger than 10^8)
+          return NULL;
+     }
+     if(oldp == NULL){
+          return smalloc(size);                   // Bullet Succes.b. smalloc equivalant
+     }
+     Slab* slab = find_slab(oldp);
+     if( slab ){
+          if( size <= slab->object_size ){
+               return oldp;                       // Still fits the size class
+          }
+          void* new_block = smalloc(size);
+          if(!new_block){
+               return NULL;
+          }
+          std::memmove(new_block, oldp, slab->object_size);
+          sfree(oldp);
+          return new_block;
+     }
+     MallocMetadata* block_Metadata = header_of(oldp);
+     size_t required_size = size + sizeof(MallocMetadata);
+     if( MALLOC_PROFILE && block_Metadata->is_sampled ){
+          profile_release(oldp);                  // Resizing ends the sample, even in place
+     }
+
+     if( block_Metadata != ((MallocMetadata*)oldp) - 1 ){   // Aligned payload, realloc does not keep the alignment
+          size_t capacity = (char*)block_Metadata + block_Metadata->size - (char*)oldp;
+          void* new_block = smalloc(size);
+          if(!new_block){
+               return NULL;
+          }
+          std::memmove(new_block, oldp, std::min(capacity, size));
+          sfree(oldp);
+          return new_block;
+     }
+
+     if(block_Metadata->is_mmap){
+          if( required_size >= DefaultHeap::mmap_threshold ){
+               return resize_mmap_block(block_Metadata, size);
+          }
+          void* new_block = smalloc(size);                // Small enough for the buddy heap again
+          if(!new_block) {
+               return NULL;
+          }
+          std::memmove(new_block, oldp, std::min(block_Metadata->size - sizeof(MallocMetadata), size));
+          sfree(oldp);
+          return new_block;
+     }
+
+     int target_order = DefaultHeap::get_order_from_size(size);
+     if(block_Metadata->size >= required_size){         // Re-use the oldp, it is good enuogh
+          pthread_mutex_lock(&heap_lock);
+          heap.shrink_in_place(block_Metadata, target_order);
+          pthread_mutex_unlock(&heap_lock);
+          return hand_out(block_Metadata);
+     }
+
+     if( target_order != -1 && required_size < DefaultHeap::mmap_threshold ){
+          size_t old_payload = block_Metadata->size - sizeof(MallocMetadata);
+          pthread_mutex_lock(&heap_lock);         // The buddy check and the merge must see the same heap
+          MallocMetadata* merged = heap.merge_for_growth(block_Metadata, target_order);
+          pthread_mutex_unlock(&heap_lock);
+          if( merged ){
+               if( merged != block_Metadata ){    // Lower buddies were absorbed, so the data has to move down once
+                    std::memmove((void*)(merged + 1), oldp, old_payload);
+               }
+               return hand_out(merged);
+          }
+     }
+
+     void* new_block = smalloc(size);             // If here we need a new memory allocation
+     if(!new_block){
+          return NULL;
+     }
+
+     std::memmove(new_block, oldp, block_Metadata->size - sizeof(MallocMetadata));   // Payload only, the header may sit at an arena end
+     sfree(oldp);
+
+     return new_block;
+
+}
+void* smemalign(size_t alignment, size_t size){
+
+     if( !alignment || (alignment & (alignment - 1)) ){
+          return NULL;                            // Only powers of two
+     }
+     if( alignment <= sizeof(MallocMetadata) ){
+          return smalloc(size);                   // Every payload is already that aligned
+     }
+
+     pthread_once(&heap_once, initial_allocator);
+
+     if(size == ZERO_SIZE_MALLOC_REQ){
+          return NULL;
+     }
+     if(size > MAX_SIZE_MALLOC_REQ){
+          return NULL;
+     }
+
+     if( alignment + size < DefaultHeap::mmap_threshold ){      // A buddy block is aligned to its own size, so put the payload at block + alignment
+          int target_order = DefaultHeap::get_order_from_size(alignment + size - sizeof(MallocMetadata));
+          MallocMetadata* block;
+          if( THREAD_CACHE && target_order <= THREAD_CACHE_MAX_ORDER ){
+               block = thread_cache_pop(target_order);                         // sfree hands these blocks to the magazine anyway
+          }
+          else{
+               int node = numa_current_node();
+               pthread_mutex_lock(&heap_lock);
+               block = heap.buddy_allocate(target_order, node);
+               pthread_mutex_unlock(&heap_lock);
+          }
+          return profile_account(block ? place_aligned(block, alignment) : nullptr, size);
+     }
+
+     void* payload = allocate_mmap_block(size + alignment, false);      // Mappings are only page aligned, keep room to slide
+     if( !payload ){
+          return nullptr;
+     }
+     return profile_account(place_aligned(((MallocMetadata*)payload) - 1, alignment), size);
+}
+
+void* saligned_alloc(size_t alignment, size_t size){
+     return smemalign(alignment, size);
+}
+
+int sposix_memalign(void** memptr, size_t alignment, size_t size){
+     if( !alignment || (alignment & (alignment - 1)) || (alignment % sizeof(void*)) ){
+          return EINVAL;
+     }
+     if(size == ZERO_SIZE_MALLOC_REQ){
+          *memptr = NULL;
+          return 0;
+     }
+     void* p = smemalign(alignment, size);
+     if( !p ){
+          return ENOMEM;
+     }
+     *memptr = p;
+     return 0;
+}
+
+size_t susable_size(void* p){
+     if(p == NULL){
+          return 0;
+     }
+     Slab* slab = find_slab(p);
+     if( slab ){
+          return slab->object_size;
+     }
+     MallocMetadata* block_Metadata = header_of(p);
+     return (char*)block_Metadata + block_Metadata->size - (char*)p;        // Also right for aligned aliases and mmap blocks
+}
+
+size_t strim(){
+
+     pthread_once(&heap_once, initial_allocator);
+
+     MmapBlock* evicted = nullptr;
+     pthread_mutex_lock(&heap_lock);
+     size_t released = heap.purge_free_blocks();
+     for(int b=0 ; b<MMAP_CACHE_BUCKETS ; ++b){   // Cached mappings go too, they would only decay later
+          while( mmap_cache_tail[b] ){
+               mmap_cache_evict(mmap_cache_tail[b], b, &evicted);
+          }
+     }
+     pthread_mutex_unlock(&heap_lock);
+     for(MmapBlock* block = evicted ; block ; block = block->next){
+          released += block->length;
+     }
+     mmap_cache_release(evicted);
+     return released;
+}
+
+size_t smalloc_batch(size_t size, size_t count, void** out){
+
+     pthread_once(&heap_once, initial_allocator);
+
+     if(size == ZERO_SIZE_MALLOC_REQ || size > MAX_SIZE_MALLOC_REQ){
+          return 0;
+     }
+     size_t got = 0;
+     if( size + sizeof(MallocMetadata) >= DefaultHeap::mmap_threshold ){
+          while( got < count && (out[got] = allocate_mmap_block(size, false)) ){
+               got++;                             // One mapping each, nothing to share
+          }
+          return profile_account_batch(out, got, size);
+     }
+
+     int node = numa_current_node();
+     pthread_mutex_lock(&heap_lock);              // One lock for the whole batch
+     if( size <= SLAB_MAX_SIZE ){
+          while( got < count && (out[got] = slab_allocate(size, node)) ){
+               got++;
+          }
+          pthread_mutex_unlock(&heap_lock);
+          return profile_account_batch(out, got, size);
+     }
+     int target_order = DefaultHeap::get_order_from_size(size);
+     while( got < count ){
+          size_t remaining = count - got;                                       // Take one block big enough for the rest, or as close as we get
+          int want_order = std::min(MAX_ORDER, target_order + (63 - __builtin_clzll(remaining)));
+          MallocMetadata* block = nullptr;
+          int block_order = want_order;
+          for( ; block_order >= target_order && !block ; --block_order ){       // Existing arenas of the node first, big to small
+               for(int i=0 ; i<heap.arena_count && !block ; ++i){
+                    if( heap.arena_order[i]->node == node ){
+                         block = heap.arena_allocate(heap.arena_order[i], block_order);
+                    }
+               }
+          }
+          block_order++;
+          if( !block ){
+               block       = heap.buddy_allocate(want_order, node);                  // Heap is out of them, grow by an arena
+               block_order = want_order;
+          }
+          if( !block ){
+               break;
+          }
+          size_t children = (size_t)1 << (block_order - target_order);          // Hand out its order-k children in one pass
+          size_t child_size = ZERO_ORDER_BLOCK_SIZE << target_order;
+          bool is_zero = block -> is_zero;
+          heap.used_per_order[block_order]--;
+          heap.used_per_order[target_order] += children;
+          heap.arena_of(block)->live_blocks += children - 1;
+          heap.splits += children - 1;                                          // What splitting down to each child would have taken
+          for(size_t i=0 ; i<children ; ++i){
+               MallocMetadata* child  = (MallocMetadata*)((char*)block + i * child_size);
+               child -> size          = child_size;
+               child -> order         = target_order;
+               child -> is_free       = false;
+               child -> is_mmap       = false;
+               child -> is_aligned    = false;
+               child -> is_zero       = is_zero;
+               child -> is_purged     = false;
+               out[got++]             = hand_out(child);
+          }
+     }
+     pthread_mutex_unlock(&heap_lock);
+     return profile_account_batch(out, got, size);
+}
+
+void sfree_batch(void** ptrs, size_t count){      // Sorts ptrs in place and uses it as scratch space
+     std::sort(ptrs, ptrs + count, [](void* a, void* b){ return (uintptr_t)a < (uintptr_t)b; });
+     count = std::unique(ptrs, ptrs + count) - ptrs;                            // The same pointer twice is freed once
+
+     for(size_t i=0 ; i<count ; ++i){             // mmap blocks take the lock on their own
+          if( ptrs[i] && !find_slab(ptrs[i]) && header_of(ptrs[i])->is_mmap ){
+               sfree(ptrs[i]);
+               ptrs[i] = nullptr;
+          }
+     }
+     for(size_t i=0 ; MALLOC_PROFILE && i<count ; ++i){                         // Samples end while the blocks are still whole
+          Slab* slab = ptrs[i] ? find_slab(ptrs[i]) : nullptr;
+          if( ptrs[i] && (slab ? slab_object_sampled(slab, ptrs[i]) : header_of(ptrs[i])->is_sampled) ){
+               profile_release(ptrs[i]);
+          }
+     }
+
+     size_t top = 0;                              // ptrs[0..top) is a stack of freed blocks, ascending and not yet merged
+     pthread_mutex_lock(&heap_lock);
+     for(size_t i=0 ; i<count ; ++i){
+          void* p = ptrs[i];
+          if( !p ){
+               continue;
+          }
+          Slab* slab = find_slab(p);
+          if( slab ){
+               slab_free(slab, p);
+               continue;
+          }
+          MallocMetadata* block = header_of(p);
+          if( block->is_free ){
+               continue;                          // Double free, or the same pointer twice in the batch
+          }
+          block -> is_free = true;
+          block -> is_zero = false;
+          block -> is_purged = false;
+          heap.used_per_order[block->order]--;
+          heap.arena_of(block)->live_blocks--;
+          while( top && block->order < MAX_ORDER ){                             // Sorted, so a freed lower buddy is right below on the stack
+               MallocMetadata* lower = (MallocMetadata*)ptrs[top - 1];
+               size_t block_size = ZERO_ORDER_BLOCK_SIZE << block->order;
+               if( lower->order != block->order || ((uintptr_t)lower ^ block_size) != (uintptr_t)block ){
+                    break;                        // Arenas are aligned to their size, so the xor stays inside one
+               }
+               top--;
+               heap.merges++;
+               lower -> order++;
+               lower -> size = ZERO_ORDER_BLOCK_SIZE << lower->order;
+               block = lower;
+          }
+          ptrs[top++] = (void*)block;
+     }
+     for(size_t i=0 ; i<top ; ++i){               // What is left meets the free lists once
+          MallocMetadata* block = (MallocMetadata*)ptrs[i];
+          heap.coalesce_and_insert(heap.arena_of(block), block);
+     }
+     pthread_mutex_unlock(&heap_lock);
+}
+//============ malloc_3 implemintations end ============
+
+//=============== Persistent heap related start ========
+// A buddy heap kept in a file, for data that should outlive the process. The file holds a header, the
+// heap descriptor (one arena, offset links) and the buddy region, so sheap_open() on an existing file
+// maps it and fixes up two pointers, no matter how much is allocated. The region is mapped at the same
+// address as last time when the kernel allows, then raw pointers inside it stay valid as well; otherwise
+// sheap_moved() says so and only offsets (like sheap_root()) survive. Blocks bigger than a top block
+// have nowhere to go, there is no mmap fallback. The owner holds an flock on the file, so a file marked
+// in use without one lost its owner to a crash; its free lists are then rebuilt from the headers.
+typedef BuddyHeap<ZERO_ORDER_BLOCK_SIZE, PERSISTENT_MAX_ORDER, PERSISTENT_TOTAL_BLOCKS, 1, OffsetPtr> PersistentBuddyHeap;
+
+struct PersistentHeapHeader{                                    // First bytes of the file, read before anything is mapped
+     uint64_t            magic;
+     uint32_t            version;
+     uint32_t            min_block;                             // Geometry it was made with, nothing else can open it
+     uint32_t            max_order;
+     uint32_t            total_blocks;
+     uint32_t            in_use;                                // Set while a process has it open, a crash leaves it set behind
+     uint64_t            region_offset;                         // Where the buddy region starts in the file
+     char*               mapped_at;                             // Region base last time, asked for again on open
+     uint64_t            root;                                  // Region offset of the root object, 0 for none
+};
+
+struct PersistentHeapFile{
+     PersistentHeapHeader header;
+     PersistentBuddyHeap  heap;
+};
+
+struct PersistentHeap{                                          // Per process handle, from the ordinary heap
+     PersistentHeapFile* file;
+     char*               region;
+     size_t              length;                                // Whole mapping, header included
+     int                 fd;
+     bool                moved;                                 // Mapped at another address than last time
+     bool                recovered;                             // Its last owner died with it open, the lists were rebuilt
+     pthread_mutex_t     lock;                                  // Guards the file's heap, like heap_lock does for heap
+};
+
+size_t persistent_region_offset(){
+     return (sizeof(PersistentHeapFile) + page_size - 1) & ~(page_size - 1);
+}
+
+char* persistent_map(int fd, char* hint){         // Returns the region base, aligned to its size as arena_of expects
+     size_t arena_size    = PersistentBuddyHeap::arena_size;
+     size_t region_offset = persistent_region_offset();
+     size_t length        = region_offset + arena_size;
+     if( hint ){
+          char* want = hint - region_offset;
+          char* got  = (char*)mmap(want, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+          if( got == want ){
+               return hint;
+          }
+          if( got != MAP_FAILED ){
+               munmap(got, length);               // Kernels before 4.17 take the flag as a plain hint
+          }
+     }
+     char* raw = (char*)mmap(nullptr, length + arena_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+     if( raw == MAP_FAILED ){
+          return nullptr;
+     }
+     char* region = (char*)(((uintptr_t)raw + region_offset + arena_size - 1) & ~(arena_size - 1));
+     if( mmap(region - region_offset, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ){
+          munmap(raw, length + arena_size);
+          return nullptr;
+     }
+     if( region - region_offset > raw ){                                        // Same alligment trick, trim the reservation
+          munmap(raw, (region - region_offset) - raw);
+     }
+     if( raw + length + arena_size > region + arena_size ){
+          munmap(region + arena_size, (raw + length + arena_size) - (region + arena_size));
+     }
+     return region;
+}
+
+PersistentHeap* sheap_open(const char* path){    // Creates the file when it is missing or empty, nullptr and errno on failure
+     pthread_once(&heap_once, initial_allocator);
+     int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+     if( fd < 0 ){
+          return nullptr;
+     }
+     if( flock(fd, LOCK_EX | LOCK_NB) ){                                        // Held until sheap_close() or exit, the kernel drops it on a crash
+          int error = (errno == EWOULDBLOCK) ? EBUSY : errno;
+          close(fd);
+          errno = error;
+          return nullptr;
+     }
+     size_t length = persistent_region_offset() + PersistentBuddyHeap::arena_size;
+     PersistentHeapHeader header;
+     struct stat st;
+     if( fstat(fd, &st) ){
+          int error = errno;
+          close(fd);                                                            // Drops the lock too
+          errno = error;
+          return nullptr;
+     }
+     bool fresh = st.st_size == 0;
+     int error = 0;
+     if( fresh ){
+          error = ftruncate(fd, length) ? errno : 0;                            // Sparse, blocks only take disk space once written
+     }
+     else if( (size_t)st.st_size != length || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+              header.magic != PERSISTENT_MAGIC || header.version != PERSISTENT_VERSION ||
+              header.min_block != ZERO_ORDER_BLOCK_SIZE || header.max_order != PERSISTENT_MAX_ORDER ||
+              header.total_blocks != PERSISTENT_TOTAL_BLOCKS || header.region_offset != persistent_region_offset() ){
+          error = EINVAL;                                                       // Not a heap, or one of another geometry
+     }
+     char* region = error ? nullptr : persistent_map(fd, fresh ? nullptr : header.mapped_at);
+     PersistentHeap* handle = region ? (PersistentHeap*)smalloc(sizeof(PersistentHeap)) : nullptr;
+     if( !handle ){
+          error = error ? error : ENOMEM;
+          if( region ){
+               munmap(region - persistent_region_offset(), length);
+          }
+          close(fd);
+          errno = error;
+          return nullptr;
+     }
+
+     PersistentHeapFile* file = (PersistentHeapFile*)(region - persistent_region_offset());
+     if( fresh ){
+          file -> header.magic          = PERSISTENT_MAGIC;
+          file -> header.version        = PERSISTENT_VERSION;
+          file -> header.min_block      = ZERO_ORDER_BLOCK_SIZE;
+          file -> header.max_order      = PERSISTENT_MAX_ORDER;
+          file -> header.total_blocks   = PERSISTENT_TOTAL_BLOCKS;
+          file -> header.region_offset  = persistent_region_offset();
+          file -> heap.initial_arena(&file->heap.arenas[0], region, true);      // Never unmapped by the heap, like the sbrk arena
+     }
+     else{                                        // The links are offsets, only the base and the arena_order entry move
+          file -> heap.arenas[0].base   = region;
+          file -> heap.arena_order[0]   = &file->heap.arenas[0];
+     }
+     handle -> recovered          = !fresh && header.in_use;                   // We hold the lock, so whoever set it is gone
+     if( handle->recovered && !file->heap.rebuild_from_headers() ){
+          sfree(handle);
+          munmap(file, length);
+          close(fd);
+          errno = EUCLEAN;                        // Died inside a split or merge, a header is torn
+          return nullptr;
+     }
+     handle -> moved              = !fresh && region != header.mapped_at;
+     file -> header.mapped_at     = region;
+     file -> header.in_use        = 1;
+     handle -> file               = file;
+     handle -> region             = region;
+     handle -> length             = length;
+     handle -> fd                 = fd;
+     pthread_mutex_init(&handle->lock, nullptr);
+     return handle;
+}
+
+int sheap_close(PersistentHeap* h){               // Everything reaches the file before this returns, -1 and errno if not
+     pthread_mutex_lock(&h->lock);
+     h -> file -> header.in_use = 0;
+     int result = msync(h->file, h->length, MS_SYNC);
+     pthread_mutex_unlock(&h->lock);
+     munmap(h->file, h->length);
+     close(h->fd);
+     pthread_mutex_destroy(&h->lock);
+     sfree(h);
+     return result;
+}
+
+void* sheap_malloc(PersistentHeap* h, size_t size){
+     if( size == ZERO_SIZE_MALLOC_REQ || size > PersistentBuddyHeap::top_block_size - sizeof(MallocMetadata) ){
+          return nullptr;                         // Before get_order_from_size, adding the header would wrap around
+     }
+     int order = PersistentBuddyHeap::get_order_from_size(size);
+     if( order == -1 ){
+          return nullptr;                         // No mmap blocks in a file heap
+     }
+     pthread_mutex_lock(&h->lock);
+     MallocMetadata* block = h->file->heap.buddy_allocate(order);
+     pthread_mutex_unlock(&h->lock);
+     return block ? (void*)(block + 1) : nullptr;
+}
+
+void sheap_free(PersistentHeap* h, void* p){
+     if( !p ){
+          return;
+     }
+     MallocMetadata* block = ((MallocMetadata*)p) - 1;
+     if( (char*)block < h->region || (char*)block >= h->region + PersistentBuddyHeap::arena_size ){
+          return;                                 // Not from this heap
+     }
+     pthread_mutex_lock(&h->lock);
+     if( !block->is_free ){
+          h -> file -> heap.buddy_free(block);
+     }
+     pthread_mutex_unlock(&h->lock);
+}
+
+void sheap_set_root(PersistentHeap* h, void* p){  // What sheap_root() hands back after the next open
+     h -> file -> header.root = p ? (char*)p - h->region : 0;
+}
+
+void* sheap_root(PersistentHeap* h){
+     return h->file->header.root ? h->region + h->file->header.root : nullptr;
+}
+
+bool sheap_moved(PersistentHeap* h){              // Raw pointers stored in the heap are stale when this is true
+     return h->moved;
+}
+
+bool sheap_recovered(PersistentHeap* h){          // Blocks the dead owner had not freed yet are still allocated
+     return h->recovered;
+}
+//================ Persistent heap related end =========
+
+#ifdef MALLOC_DEBUG
+//============ Debug walkers, heap_lock held ============
+size_t walk_free_blocks(){
+     size_t free_blocks_count, cached_bytes;
+     thread_cache_totals(&free_blocks_count, &cached_bytes);
+     free_blocks_count += slab_free_slots;                  // Every free slab object counts as a free block
+     for(int a = 0 ; a<heap.arena_count ; a++){
+          for(int i = 0 ; i<=MAX_ORDER ; i++){
+               FreeBlock* current_p = heap.arena_order[a]->free_list[i];
+               while(current_p){
+                    free_blocks_count++;
+                    current_p = current_p->next;
+               }
+               for(current_p = heap.arena_order[a]->quick_list[i] ; current_p ; current_p = current_p->next){
+                    free_blocks_count++;                // Free, just not merged yet
+               }
+          }
+     }
+     return free_blocks_count;
+}
+size_t walk_free_bytes(){
+     size_t cached_blocks, free_bytes_count;
+     thread_cache_totals(&cached_blocks, &free_bytes_count);
+     free_bytes_count += slab_free_bytes;
+     for(int a = 0 ; a<heap.arena_count ; a++){
+          for(int i = 0 ; i<=MAX_ORDER ; i++){
+               FreeBlock* current_p = heap.arena_order[a]->free_list[i];
+               while(current_p){
+                    free_bytes_count += (current_p->header.size - sizeof(MallocMetadata));
+                    current_p = current_p->next;
+               }
+               for(current_p = heap.arena_order[a]->quick_list[i] ; current_p ; current_p = current_p->next){
+                    free_bytes_count += (current_p->header.size - sizeof(MallocMetadata));
+               }
+          }
+     }
+     return free_bytes_count;
+}
+size_t walk_allocated_blocks(){
+     size_t alloced_blocks_count, cached_bytes;
+     thread_cache_totals(&alloced_blocks_count, &cached_bytes);
+     alloced_blocks_count += slab_slots - slab_count;       // A slab block is reported as its object slots
+     for(int a = 0 ; a<heap.arena_count ; a++){
+          Arena* arena = heap.arena_order[a];
+          for(int i=0 ; i<=MAX_ORDER ; i++){           // Count the free blocks
+               FreeBlock* block = arena->free_list[i];
+               while(block){
+                    alloced_blocks_count++;
+                    block = block->next;
+               }
+               for(block = arena->quick_list[i] ; block ; block = block->next){
+                    alloced_blocks_count++;
+               }
+          }
+          size_t offset = 0;
+          while(offset < DefaultHeap::arena_size){                  // Count the !free blocks
+               MallocMetadata* block = (MallocMetadata*)(arena->base + offset);
+               if( !block->is_free && !block->is_mmap ){
+                    alloced_blocks_count++;
+               }
+               offset += block->size;
+          }
+     }
+     MmapBlock* mmap_curr = mmap_list;
+     while (mmap_curr) {
+          alloced_blocks_count++;
+         mmap_curr = mmap_curr->next;
+     }
+     return alloced_blocks_count;
+}
+size_t walk_allocated_bytes(){
+     size_t cached_blocks, alloced_bytes_count;
+     thread_cache_totals(&cached_blocks, &alloced_bytes_count);
+     alloced_bytes_count += slab_slot_bytes - slab_buddy_bytes;
+     for(int a = 0 ; a<heap.arena_count ; a++){
+          Arena* arena = heap.arena_order[a];
+          for(int i=0 ; i<=MAX_ORDER ; i++){           // Count the free blocks
+               FreeBlock* block = arena->free_list[i];
+               while(block){
+                    alloced_bytes_count += (block->header.size - sizeof(MallocMetadata));
+                    block = block->next;
+               }
+               for(block = arena->quick_list[i] ; block ; block = block->next){
+                    alloced_bytes_count += (block->header.size - sizeof(MallocMetadata));
+               }
+          }
+          size_t offset = 0;
+          while(offset < DefaultHeap::arena_size){                  // Count the !free blocks
+               MallocMetadata* block = (MallocMetadata*)(arena->base + offset);
+               if( !block->is_free && !block->is_mmap ){
+                    alloced_bytes_count += (block->size - sizeof(MallocMetadata));
+               }
+               offset += block->size;
+          }
+     }
+     MmapBlock* mmap_curr = mmap_list;
+     while (mmap_curr) {
+          alloced_bytes_count += (mmap_curr->header.size - sizeof(MallocMetadata));
+         mmap_curr = mmap_curr->next;
+     }
+     return alloced_bytes_count;
+}
+#endif
+
+//============= Heap checker related start =============
+bool on_quick_list(Arena* arena, MallocMetadata* header, int order){
+     FreeBlock* block = arena->quick_list[order];
+     for(int i=0 ; block && i<=QUICK_LIST_LIMIT ; ++i, block = block->next){  // Bounded, a looping list is reported elsewhere
+          if( &block->header == header ){
+               return true;
+          }
+     }
+     return false;
+}
+
+size_t check_arena(Arena* arena, size_t* free_seen, size_t* used_seen, size_t* dirty, size_t* purged, size_t* slabs, size_t* slab_free){
+     size_t problems = 0;
+     for(int order=0 ; order<=MAX_ORDER ; ++order){                             // Free lists against headers and bitmaps
+          size_t listed = 0, limit = DefaultHeap::arena_size >> (order + DefaultHeap::min_shift);
+          FreeBlock* prev = nullptr;
+          for(FreeBlock* block = arena->free_list[order] ; block ; block = block->next){
+               size_t offset = (char*)block - arena->base;
+               if( offset >= DefaultHeap::arena_size || (offset & ((DefaultHeap::min_block << order) - 1)) || ++listed > limit ){
+                    report_heap_problem("free list leaves its arena or loops", block);
+                    problems++;
+                    break;                                                      // Anything further would read wild memory
+               }
+               MallocMetadata* header = &block->header;
+               if( block->prev != prev ){
+                    report_heap_problem("free list back link broken", block);
+                    problems++;
+               }
+               if( !header->is_free || header->order != order || header->size != (DefaultHeap::min_block << order) ){
+                    report_heap_problem("free list entry with a wrong header", block);
+                    problems++;
+                    break;                                                      // Overwritten, its links are no better than its header
+               }
+               if( !heap.test_free_bit(arena, offset, order) ){
+                    report_heap_problem("free block missing from the bitmap", block);
+                    problems++;
+               }
+               if( order < MAX_ORDER && heap.test_free_bit(arena, offset ^ header->size, order) ){
+                    report_heap_problem("free buddies left unmerged", block);
+                    problems++;
+               }
+               if( order >= DefaultHeap::purge_min_order ){
+                    *(header->is_purged ? purged : dirty) += header->size;
+               }
+               prev = block;
+          }
+          free_seen[order] += listed;
+          if( order == MAX_ORDER && (int)listed != arena->free_top_blocks ){
+               report_heap_problem("free_top_blocks out of date", arena->base);
+               problems++;
+          }
+          size_t bits = 0;
+          uint32_t first = DefaultHeap::Tables::bitmap_offset[order];
+          size_t words = order_bitmap_words(TOTAL_BLOCKS, MAX_ORDER, order);
+          for(size_t w=0 ; w<words ; ++w){
+               uint64_t word    = arena->free_bitmap[first + w];
+               uint64_t summary = arena->free_summary[DefaultHeap::Tables::summary_offset[order] + w / BITS_PER_WORD];
+               bits += __builtin_popcountll(word);
+               if( ((summary >> (w % BITS_PER_WORD)) & 1) != (word != 0) ){
+                    report_heap_problem("summary bitmap disagrees with its word", arena->base);
+                    problems++;
+               }
+          }
+          if( bits != listed ){
+               report_heap_problem("bitmap and free list disagree", arena->base);
+               problems++;
+          }
+
+          size_t quick = 0;
+          for(FreeBlock* block = arena->quick_list[order] ; block ; block = block->next){   // Free blocks whose merge was put off
+               size_t offset = (char*)block - arena->base;
+               if( offset >= DefaultHeap::arena_size || (offset & ((DefaultHeap::min_block << order) - 1)) || ++quick > QUICK_LIST_LIMIT ){
+                    report_heap_problem("quick list leaves its arena or loops", block);
+                    problems++;
+                    break;
+               }
+               MallocMetadata* header = &block->header;
+               if( !header->is_free || header->order != order || header->size != (DefaultHeap::min_block << order) || order == MAX_ORDER ){
+                    report_heap_problem("quick list entry with a wrong header", block);
+                    problems++;
+                    break;
+               }
+               if( heap.test_free_bit(arena, offset, order) ){
+                    report_heap_problem("quick list block also on a free list", block);
+                    problems++;
+               }
+               if( order >= DefaultHeap::purge_min_order ){
+                    *(header->is_purged ? purged : dirty) += header->size;
+               }
+          }
+          if( (int)quick != arena->quick_count[order] ){
+               report_heap_problem("quick_count out of date", arena->base);
+               problems++;
+          }
+          free_seen[order] += quick;
+     }
+
+     int live = 0;
+     for(size_t offset = 0 ; offset < DefaultHeap::arena_size ; ){              // Physical walk, every header in address order
+          MallocMetadata* header = (MallocMetadata*)(arena->base + offset);
+          int order = header->order;
+          if( order < 0 || order > MAX_ORDER || header->size != (DefaultHeap::min_block << order) || (offset & (header->size - 1)) || header->is_mmap ){
+               report_heap_problem("corrupted block header", header);
+               return problems + 1;                                             // No size to step over it
+          }
+          if( DEFERRED_COALESCE && header->is_free && !heap.test_free_bit(arena, offset, order) && on_quick_list(arena, header, order) ){
+               offset += header->size;                                          // Counted with its quick list above
+               continue;
+          }
+          if( !header->is_free || !heap.test_free_bit(arena, offset, order) ){
+               used_seen[order]++;                                              // Live, or parked in a thread cache
+               live++;
+               size_t index = offset >> (order + DefaultHeap::min_shift);
+               bool is_slab = order <= SLAB_MAX_ORDER &&
+                              ((arena->slab_bitmap[DefaultHeap::bitmap_offset(order) + index / BITS_PER_WORD] >> (index % BITS_PER_WORD)) & 1);
+               if( is_slab ){
+                    Slab* slab = (Slab*)(header + 1);
+                    uint64_t all = (slab->capacity == 64) ? ~(uint64_t)0 : (((uint64_t)1 << slab->capacity) - 1);
+                    if( slab->order != order || (slab->free_mask & ~all) ){
+                         report_heap_problem("corrupted slab header", slab);
+                         problems++;
+                    }
+                    (*slabs)++;
+                    *slab_free += __builtin_popcountll(slab->free_mask & all);
+               }
+               else if( !header->is_free && !header_sealed(header) ){
+                    report_heap_problem("live block header fails its check", header);
+                    problems++;
+               }
+               else if( header->is_free && !THREAD_CACHE ){
+                    report_heap_problem("free block on no free list", header);
+                    problems++;
+               }
+          }
+          offset += header->size;
+     }
+     if( live != arena->live_blocks ){
+          report_heap_problem("live_blocks out of date", arena->base);
+          problems++;
+     }
+     return problems;
+}
+
+size_t scheck_heap(){                             // Full consistency walk, returns the number of problems reported on stderr
+
+     pthread_once(&heap_once, initial_allocator);
+
+     size_t problems = 0;
+     size_t free_seen[MAX_ORDER + 1] = {0}, used_seen[MAX_ORDER + 1] = {0};
+     size_t dirty = 0, purged = 0, slabs = 0, slab_free = 0, quick = 0;
+     pthread_mutex_lock(&heap_lock);
+     for(int a=0 ; a<heap.arena_count ; ++a){
+          Arena* arena = heap.arena_order[a];
+          if( a && heap.arena_order[a - 1]->base >= arena->base ){
+               report_heap_problem("arena_order not sorted by address", arena->base);
+               problems++;
+          }
+          if( heap.arena_of(arena->base) != arena ){
+               report_heap_problem("arena not found from its own base", arena->base);
+               problems++;
+          }
+          if( arena->node < 0 || arena->node >= NUMA_MAX_NODES ){
+               report_heap_problem("arena on a node out of range", arena->base);
+               problems++;
+          }
+          problems += check_arena(arena, free_seen, used_seen, &dirty, &purged, &slabs, &slab_free);
+          for(int order=0 ; order<MAX_ORDER ; ++order){
+               quick += arena->quick_count[order];
+          }
+     }
+     if( quick != heap.quick_blocks ){
+          report_heap_problem("quick_blocks disagrees with the quick lists", nullptr);
+          problems++;
+     }
+     for(int order=0 ; order<=MAX_ORDER ; ++order){
+          if( free_seen[order] != heap.free_per_order[order] || used_seen[order] != heap.used_per_order[order] ){
+               report_heap_problem("per order stats disagree with the heap", (void*)(uintptr_t)order);
+               problems++;
+          }
+     }
+     if( dirty != heap.dirty_bytes || purged != heap.purged_bytes ){
+          report_heap_problem("dirty / purged byte counters disagree with the free lists", nullptr);
+          problems++;
+     }
+     if( slabs != slab_count || slab_free != slab_free_slots ){
+          report_heap_problem("slab stats disagree with the slabs", nullptr);
+          problems++;
+     }
+
+     size_t blocks = 0, bytes = 0;
+     MmapBlock* prev = nullptr;
+     for(MmapBlock* block = mmap_list ; block ; block = block->next){
+          if( block->prev != prev || !block->header.is_mmap || block->header.is_free || !header_sealed(&block->header) ){
+               report_heap_problem("corrupted mmap block", block);
+               problems++;
+          }
+          blocks++;
+          bytes += block->header.size - sizeof(MallocMetadata);
+          prev = block;
+     }
+     if( blocks != mmap_blocks || bytes != mmap_bytes ){
+          report_heap_problem("mmap stats disagree with mmap_list", nullptr);
+          problems++;
+     }
+     pthread_mutex_unlock(&heap_lock);
+     return problems;
+}
+//============== Heap checker related end ==============
+
+void snapshot_stats_locked(MallocStats* stats){
+     size_t blocks_in_cache, bytes_in_cache;
+     size_t free_blocks_count = 0, free_bytes_count = 0, used_blocks_count = 0, used_bytes_count = 0;
+
+     thread_cache_totals(&blocks_in_cache, &bytes_in_cache);                    // Fast path pops and pushes do not take the lock, the split may lag
+     for(int i=0 ; i<=MAX_ORDER ; i++){
+          size_t payload = (ZERO_ORDER_BLOCK_SIZE << i) - sizeof(MallocMetadata);
+          stats -> free_per_order[i]    = heap.free_per_order[i];
+          stats -> used_per_order[i]    = heap.used_per_order[i];
+          free_blocks_count            += heap.free_per_order[i];
+          free_bytes_count             += heap.free_per_order[i] * payload;
+          used_blocks_count            += heap.used_per_order[i];
+          used_bytes_count             += heap.used_per_order[i] * payload;
+     }
+     stats -> free_blocks      = free_blocks_count + blocks_in_cache + slab_free_slots;      // Every free slab object counts as a free block
+     stats -> free_bytes       = free_bytes_count + bytes_in_cache + slab_free_bytes;
+     stats -> allocated_blocks = free_blocks_count + used_blocks_count - slab_count + slab_slots + mmap_blocks;  // A slab block is reported as its object slots
+     stats -> allocated_bytes  = free_bytes_count + used_bytes_count - slab_buddy_bytes + slab_slot_bytes + mmap_bytes;
+     stats -> meta_data_bytes  = (stats->allocated_blocks - slab_slots) * sizeof(MallocMetadata)   // Slab objects carry no header
+                               + slab_count * (sizeof(MallocMetadata) + sizeof(Slab));
+     stats -> size_meta_data   = sizeof(MallocMetadata);
+     stats -> mmap_blocks      = mmap_blocks;
+     stats -> mmap_bytes       = mmap_bytes;
+     stats -> dirty_bytes      = heap.dirty_bytes;
+     stats -> purged_bytes     = heap.purged_bytes;
+     stats -> quick_blocks     = heap.quick_blocks;
+     stats -> arenas           = heap.arena_count;
+     stats -> splits           = heap.splits;
+     stats -> merges           = heap.merges;
+#ifdef MALLOC_DEBUG
+     if( !THREAD_CACHE ){                                                       // The walkers only agree when no cache is in flight
+          assert(stats->free_blocks      == walk_free_blocks());
+          assert(stats->free_bytes       == walk_free_bytes());
+          assert(stats->allocated_blocks == walk_allocated_blocks());
+          assert(stats->allocated_bytes  == walk_allocated_bytes());
+     }
+#endif
+}
+
+void _snapshot_stats(MallocStats* stats){
+     pthread_mutex_lock(&heap_lock);
+     snapshot_stats_locked(stats);
+     pthread_mutex_unlock(&heap_lock);
+}
+
+size_t _num_free_blocks(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.free_blocks;
+}
+size_t _num_free_bytes(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.free_bytes;
+}
+size_t _num_allocated_blocks(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.allocated_blocks;
+}
+size_t _num_allocated_bytes(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.allocated_bytes;
 }
 size_t _num_meta_data_bytes(){
-     return _num_allocated_blocks() * _size_meta_data();
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.meta_data_bytes;
 }
 size_t _size_meta_data(){
      return sizeof(MallocMetadata);
 }
+
+#ifdef MALLOC_INTERPOSE
+//=============== Interposition related start ==========
+// Build as a preloadable library that replaces the libc allocator:
+//   g++ -std=c++11 -O2 -shared -fPIC -fno-semantic-interposition -DMALLOC_INTERPOSE -DTHREAD_CACHE=1 -DMAX_SIZE_MALLOC_REQ=... -DMAX_ARENAS=... malloc_3.cpp -o libsmalloc.so -pthread
+// -fno-semantic-interposition lets the calls between the s* functions bind locally instead of through the PLT.
+char interpose_bootstrap[MALLOC_INTERPOSE_BOOTSTRAP] __attribute__((aligned(MALLOC_INTERPOSE_ALIGNMENT)));
+size_t interpose_bootstrap_used = 0;             // Only the thread inside initial_allocator touches it, the rest wait in pthread_once
+
+void* bootstrap_alloc(size_t size){
+     size_t start = (interpose_bootstrap_used + MALLOC_INTERPOSE_ALIGNMENT - 1) & ~(size_t)(MALLOC_INTERPOSE_ALIGNMENT - 1);
+     if( start + size > MALLOC_INTERPOSE_BOOTSTRAP ){
+          return nullptr;
+     }
+     interpose_bootstrap_used = start + size;
+     return interpose_bootstrap + start;         // Static storage, already zero and never reused
+}
+
+bool is_bootstrap(void* p){
+     return (char*)p >= interpose_bootstrap && (char*)p < interpose_bootstrap + MALLOC_INTERPOSE_BOOTSTRAP;
+}
+
+static_assert(MALLOC_INTERPOSE_ALIGNMENT > sizeof(MallocMetadata) && MALLOC_INTERPOSE_ALIGNMENT < ZERO_ORDER_BLOCK_SIZE &&
+              !(MALLOC_INTERPOSE_ALIGNMENT & (MALLOC_INTERPOSE_ALIGNMENT - 1)), "Buddy payloads need an alias header to be that aligned");
+
+inline __attribute__((always_inline)) void* smalloc_fast_aligned(size_t size){   // smalloc_fast for payloads at FAST_PAYLOAD_OFFSET
+     const size_t shift = MALLOC_INTERPOSE_ALIGNMENT - sizeof(MallocMetadata);
+     if( THREAD_CACHE && size - (SLAB_MAX_SIZE + 1) < THREAD_CACHE_MAX_SIZE - shift - SLAB_MAX_SIZE ){
+          MallocMetadata* block = thread_cache_take(DefaultHeap::get_order_from_size(size + shift));
+          if( block ){
+               return profile_account(place_aligned(block, MALLOC_INTERPOSE_ALIGNMENT), size);
+          }
+     }
+     return smemalign(MALLOC_INTERPOSE_ALIGNMENT, size);
+}
+
+void* interpose_allocate(size_t size){
+     if( in_initial_allocator ){
+          return bootstrap_alloc(size);
+     }
+     if(size == ZERO_SIZE_MALLOC_REQ){
+          size = 1;                               // malloc(0) hands out a unique pointer
+     }
+     void* p;
+     if( size <= SLAB_MAX_SIZE || size + sizeof(MallocMetadata) >= DefaultHeap::mmap_threshold ){
+          p = smalloc(size);                      // Slab objects and mmap payloads are already aligned
+     }
+     else{
+          p = smalloc_fast_aligned(size);                                         // Buddy payloads sit one header past the block
+     }
+     if( !p ){
+          errno = ENOMEM;
+     }
+     return p;
+}
+
+extern "C" void* malloc(size_t size) noexcept{
+     return interpose_allocate(size);
+}
+
+extern "C" void free(void* p) noexcept{
+     if( p == NULL || is_bootstrap(p) ){
+          return;
+     }
+     sfree(p);
+}
+
+extern "C" void* calloc(size_t num, size_t size) noexcept{
+     if( size && num > SIZE_MAX / size ){
+          errno = ENOMEM;
+          return NULL;
+     }
+     size_t total_size = num * size;
+     if( in_initial_allocator || total_size == ZERO_SIZE_MALLOC_REQ ){
+          return interpose_allocate(total_size);  // Bootstrap memory is static and never reused, so already zero
+     }
+     void* p;
+     if( total_size <= SLAB_MAX_SIZE || total_size + sizeof(MallocMetadata) >= DefaultHeap::mmap_threshold ){
+          p = scalloc(num, size);                 // Same placement as interpose_allocate, so just as aligned
+     }
+     else if( (p = interpose_allocate(total_size)) ){
+          clear_payload(header_of(p), p, total_size);
+     }
+     if( !p ){
+          errno = ENOMEM;
+     }
+     return p;
+}
+
+extern "C" void* realloc(void* oldp, size_t size) noexcept{
+     if(oldp == NULL){
+          return interpose_allocate(size);
+     }
+     if(size == ZERO_SIZE_MALLOC_REQ){
+          free(oldp);                             // Same as glibc
+          return NULL;
+     }
+     size_t usable;
+     if( is_bootstrap(oldp) ){
+          usable = interpose_bootstrap + MALLOC_INTERPOSE_BOOTSTRAP - (char*)oldp;
+     }
+     else{
+          usable = susable_size(oldp);
+          if( size <= usable && size >= usable / 2 ){
+               return oldp;                       // Fits without wasting more than half of it
+          }
+          MallocMetadata* block_Metadata = find_slab(oldp) ? nullptr : header_of(oldp);   // Slab objects have no header
+          if( block_Metadata == ((MallocMetadata*)oldp) - 1 && block_Metadata->is_mmap && size + sizeof(MallocMetadata) >= DefaultHeap::mmap_threshold ){
+               void* p = srealloc(oldp, size);    // mremap keeps the mmap payload alignment
+               if( !p ){
+                    errno = ENOMEM;
+               }
+               return p;
+          }
+     }
+     void* p = interpose_allocate(size);          // srealloc may return a less aligned buddy payload, so move it here
+     if( !p ){
+          return NULL;
+     }
+     std::memcpy(p, oldp, std::min(usable, size));
+     free(oldp);
+     return p;
+}
+
+extern "C" size_t malloc_usable_size(void* p) noexcept{
+     if( p == NULL || is_bootstrap(p) ){
+          return 0;
+     }
+     return susable_size(p);
+}
+
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept{
+     if( alignment <= MALLOC_INTERPOSE_ALIGNMENT && !(alignment & (alignment - 1)) && !(alignment % sizeof(void*)) ){
+          *memptr = interpose_allocate(size);     // Every pointer we hand out is at least this aligned
+          return *memptr ? 0 : ENOMEM;
+     }
+     return sposix_memalign(memptr, alignment, size ? size : 1);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size) noexcept{
+     if( alignment <= MALLOC_INTERPOSE_ALIGNMENT ){
+          return interpose_allocate(size);
+     }
+     void* p = smemalign(alignment, size ? size : 1);
+     if( !p ){
+          errno = (alignment & (alignment - 1)) ? EINVAL : ENOMEM;
+     }
+     return p;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) noexcept{
+     return memalign(alignment, size);
+}
+
+extern "C" void* valloc(size_t size) noexcept{
+     return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+extern "C" void* pvalloc(size_t size) noexcept{
+     size_t page = sysconf(_SC_PAGESIZE);
+     return memalign(page, (size + page - 1) & ~(page - 1));
+}
+//================ Interposition related end ===========
+#endif
@@ -0,0 +1,82 @@
+
+// Compares filling and emptying an object pool one call at a time with doing it through
+// smalloc_batch / sfree_batch, which take the heap lock once and split / merge whole subtrees.
+//   g++ -std=c++11 -O2 malloc_batch_bench.cpp malloc_3.cpp -o batch_bench -pthread
+//   ./batch_bench [rounds] [objects] [size]
+// One round allocates the whole pool and frees it again, in allocation order for the per-call loop.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_ROUNDS      20000
+#define BENCH_DEFAULT_OBJECTS     512
+#define BENCH_DEFAULT_SIZE        200
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t smalloc_batch(size_t size, size_t count, void** out);
+void  sfree_batch(void** ptrs, size_t count);
+size_t scheck_heap();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+double per_call(std::vector<void*>& pool, size_t size, long rounds){   // ms for all rounds
+     uint64_t start = monotonic_ns();
+     for(long r = 0 ; r < rounds ; ++r){
+          for(void*& p : pool){
+               p = smalloc(size);
+               *(volatile char*)p = 1;
+          }
+          for(void* p : pool){
+               sfree(p);
+          }
+     }
+     return (double)(monotonic_ns() - start) / 1000000;
+}
+
+double batched(std::vector<void*>& pool, size_t size, long rounds){
+     uint64_t start = monotonic_ns();
+     for(long r = 0 ; r < rounds ; ++r){
+          size_t got = smalloc_batch(size, pool.size(), pool.data());
+          for(size_t i = 0 ; i < got ; ++i){
+               *(volatile char*)pool[i] = 1;
+          }
+          sfree_batch(pool.data(), got);
+     }
+     return (double)(monotonic_ns() - start) / 1000000;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long rounds  = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_ROUNDS;
+     long objects = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_OBJECTS;
+     long size    = argc >= 4 ? atol(argv[3]) : BENCH_DEFAULT_SIZE;
+     if( rounds <= 0 || objects <= 0 || size <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [rounds] [objects] [size]" << std::endl;
+          return 1;
+     }
+
+     std::vector<void*> pool(objects);
+     size_t got = smalloc_batch(size, objects, pool.data());
+     sfree_batch(pool.data(), got);
+     if( got != (size_t)objects ){
+          std::cerr << "smalloc_batch(" << size << ", " << objects << ") filled " << got << std::endl;
+          return 1;
+     }
+     double single = per_call(pool, size, rounds);
+     double batch  = batched(pool, size, rounds);
+     printf("%ld rounds of %ld x %ld B: per call %8.1f ms, batch %8.1f ms\n", rounds, objects, size, single, batch);
+     return scheck_heap() ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+
+// Random smalloc_batch / sfree_batch traffic against malloc_3: batches of slab, buddy and mmap sizes
+// are freed again in random groups that may hold the same pointer twice and a NULL.
+//   g++ -std=c++11 -O2 malloc_batch_test.cpp malloc_3.cpp -o batch_test -pthread
+//   g++ -std=c++11 -O2 -DMALLOC_DEBUG malloc_batch_test.cpp malloc_3.cpp -o batch_test_debug -pthread
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 -DMALLOC_DEBUG malloc_batch_test.cpp malloc_3.cpp -o batch_test_deferred -pthread
+//   ./batch_test [iterations] [seed]
+// Exits with the number of failed checks. The stats are read every 1000 iterations, which in a
+// MALLOC_DEBUG build asserts that the O(1) counters agree with the walkers.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdint.h>
+
+#define TEST_DEFAULT_ITERATIONS   20000
+#define TEST_DEFAULT_SEED         9
+#define TEST_MAX_BATCH            300
+#define TEST_FILLED               64               // Bytes written and checked at the start of every block
+
+
+//================ Allocator related start =============
+size_t smalloc_batch(size_t size, size_t count, void** out);
+void  sfree_batch(void** ptrs, size_t count);
+size_t scheck_heap();
+size_t _num_free_blocks();
+size_t _num_allocated_blocks();
+//================= Allocator related end ==============
+
+//================== Test related start ================
+struct Block{
+     unsigned char*      p;
+     size_t              size;
+};
+
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+unsigned char fill_of(const void* p){             // Differs between neighbours, so a mixed up block shows
+     return (unsigned char)((uintptr_t)p >> 4);
+}
+
+bool intact(const Block& block){
+     for(size_t k = 0 ; k < std::min(block.size, (size_t)TEST_FILLED) ; ++k){
+          if( block.p[k] != fill_of(block.p) ){
+               return false;
+          }
+     }
+     return true;
+}
+
+size_t random_size(std::mt19937& rng){            // Slab and buddy sizes, now and then an mmap block
+     if( rng() % 50 == 0 ){
+          return 200000;
+     }
+     return 1 + rng() % (rng() % 2 ? 200 : 20000);
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     long iterations = argc >= 2 ? atol(argv[1]) : TEST_DEFAULT_ITERATIONS;
+     unsigned seed   = argc >= 3 ? atoi(argv[2]) : TEST_DEFAULT_SEED;
+     if( iterations <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [iterations] [seed]" << std::endl;
+          return 1;
+     }
+
+     void* none[1];
+     check(smalloc_batch(0, 1, none) == 0, "smalloc_batch(0, ...) fills nothing");
+     check(smalloc_batch(100000001, 1, none) == 0, "smalloc_batch over MAX_SIZE_MALLOC_REQ fills nothing");
+     sfree_batch(none, 0);
+     size_t used_before = _num_allocated_blocks() - _num_free_blocks();
+
+     std::mt19937 rng(seed);
+     std::vector<Block> live;
+     bool all_intact = true, all_filled = true;
+     for(long i = 0 ; i < iterations ; ++i){
+          if( rng() % 3 < 2 ){
+               size_t size  = random_size(rng);
+               size_t count = 1 + rng() % TEST_MAX_BATCH;
+               std::vector<void*> batch(count);
+               size_t got = smalloc_batch(size, count, batch.data());
+               all_filled = all_filled && got == count;
+               for(size_t k = 0 ; k < got ; ++k){
+                    Block block = {(unsigned char*)batch[k], size};
+                    memset(block.p, fill_of(block.p), std::min(size, (size_t)TEST_FILLED));
+                    live.push_back(block);
+               }
+          }
+          else if( !live.empty() ){
+               size_t count = 1 + rng() % live.size();
+               std::vector<void*> batch;
+               for(size_t k = 0 ; k < count ; ++k){
+                    size_t j = rng() % live.size();
+                    all_intact = all_intact && intact(live[j]);
+                    batch.push_back(live[j].p);
+                    live[j] = live.back();
+                    live.pop_back();
+               }
+               if( rng() % 5 == 0 ){
+                    batch.push_back(batch[0]);            // The same pointer twice is freed once
+               }
+               batch.push_back(nullptr);
+               sfree_batch(batch.data(), batch.size());
+          }
+          if( i % 1000 == 0 ){
+               _num_free_blocks();
+          }
+     }
+     check(all_filled, "every batch was filled completely");
+     check(all_intact, "every block kept its contents until freed");
+     check(scheck_heap() == 0, "scheck_heap with blocks live");
+
+     std::vector<void*> rest;
+     for(Block& block : live){
+          all_intact = all_intact && intact(block);
+          rest.push_back(block.p);
+     }
+     sfree_batch(rest.data(), rest.size());
+     check(all_intact, "blocks freed at the end were intact too");
+     check(_num_allocated_blocks() - _num_free_blocks() == used_before, "freeing everything leaves no block in use");
+     check(scheck_heap() == 0, "scheck_heap after freeing everything");
+     return failures;
+}
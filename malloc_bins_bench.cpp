@@ -0,0 +1,85 @@
+
+// Replays a random malloc/free trace against malloc_2 and reports the time and how far the program
+// break grew compared to the peak of live requested bytes. A first fit scan pays for every free block
+// ahead of the fit, the segregated bins only look at one bin and the head of the next one.
+//   g++ -std=c++11 -O2 malloc_bins_bench.cpp malloc_2.cpp -o bins_bench
+//   ./bins_bench [operations] [slots]
+// Each operation picks a slot: a live slot is freed, an empty one gets 1..128 B (70%), 1..4 KiB (25%)
+// or 1..64 KiB (5%). The seed is fixed, so runs replay the same trace.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_OPERATIONS  1000000
+#define BENCH_DEFAULT_SLOTS       4096
+#define BENCH_SEED                42
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+size_t draw_size(){
+     int r = rand() % 100;
+     if( r < 70 ){
+          return 1 + rand() % 128;
+     }
+     if( r < 95 ){
+          return 1 + rand() % 4096;
+     }
+     return 1 + rand() % 65536;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long operations = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_OPERATIONS;
+     long slots      = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_SLOTS;
+     if( operations <= 0 || slots <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [operations] [slots]" << std::endl;
+          return 1;
+     }
+
+     std::vector<void*>  live(slots, nullptr);
+     std::vector<size_t> sizes(slots, 0);
+     size_t live_bytes = 0, peak_live_bytes = 0;
+     srand(BENCH_SEED);
+     char* heap_start = (char*)sbrk(0);
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < operations ; ++i){
+          long slot = rand() % slots;
+          if( live[slot] ){
+               sfree(live[slot]);
+               live[slot]  = nullptr;
+               live_bytes -= sizes[slot];
+               continue;
+          }
+          sizes[slot] = draw_size();
+          live[slot]  = smalloc(sizes[slot]);
+          if( !live[slot] ){
+               std::cerr << "smalloc(" << sizes[slot] << ") failed" << std::endl;
+               return 1;
+          }
+          live_bytes += sizes[slot];
+          if( live_bytes > peak_live_bytes ){
+               peak_live_bytes = live_bytes;
+          }
+     }
+     double ms = (double)(monotonic_ns() - start) / 1000000;
+     size_t heap_bytes = (char*)sbrk(0) - heap_start;
+     printf("%ld ops %9.1f ms, heap %zu B, peak live %zu B, heap / peak live %.3f\n",
+            operations, ms, heap_bytes, peak_live_bytes, (double)heap_bytes / peak_live_bytes);
+     return 0;
+}
@@ -0,0 +1,61 @@
+
+// Measures scalloc of large buffers that the caller then only touches sparsely, the case where zeroing
+// memory that is already zero (fresh mappings, purged pages) is the whole cost of the call.
+//   g++ -std=c++11 -O2 malloc_calloc_bench.cpp malloc_3.cpp -o calloc_bench -pthread
+//   g++ -std=c++11 -O2 malloc_calloc_bench.cpp malloc_2.cpp -o calloc_bench_2
+//   ./calloc_bench [size] [iterations] [touch step]
+// Every buffer is checked for zero at each touched byte before it is written and freed again.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_SIZE        (8 << 20)
+#define BENCH_DEFAULT_ITERATIONS  2000
+#define BENCH_DEFAULT_STEP        (1 << 20)        // One byte per MiB
+
+
+//================ Allocator related start =============
+void* scalloc(size_t num, size_t size);
+void  sfree(void* p);
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long size       = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_SIZE;
+     long iterations = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_ITERATIONS;
+     long step       = argc >= 4 ? atol(argv[3]) : BENCH_DEFAULT_STEP;
+     if( size <= 0 || iterations <= 0 || step <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [size] [iterations] [touch step]" << std::endl;
+          return 1;
+     }
+
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < iterations ; ++i){
+          char* p = (char*)scalloc(1, size);
+          if( !p ){
+               std::cerr << "scalloc(1, " << size << ") failed" << std::endl;
+               return 1;
+          }
+          for(long k = 0 ; k < size ; k += step){
+               if( p[k] ){
+                    std::cerr << "scalloc returned a nonzero byte at " << k << std::endl;
+                    return 1;
+               }
+               p[k] = 1;
+          }
+          sfree(p);
+     }
+     double ms = (double)(monotonic_ns() - start) / 1000000;
+     printf("%ld x scalloc(1, %ld) %9.1f ms %9.2f us/call\n", iterations, size, ms, ms * 1000 / iterations);
+     return 0;
+}
@@ -0,0 +1,147 @@
+
+// Checks the DEFERRED_COALESCE build of malloc_3: random churn leaves a heap scheck_heap() accepts with
+// blocks parked on the quick lists, frees that never empty an arena still purge above PURGE_THRESHOLD,
+// and strim() merges every quick list away.
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 malloc_deferred_test.cpp malloc_3.cpp -o deferred_test -pthread
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 -DMALLOC_DEBUG malloc_deferred_test.cpp malloc_3.cpp -o deferred_test_debug -pthread
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 -DTHREAD_CACHE=1 malloc_deferred_test.cpp malloc_3.cpp -o deferred_test_tc -pthread
+//   ./deferred_test [operations] [seed]
+// Exits with the number of failed checks. The eager default build passes too, with empty quick lists.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <random>
+
+#define TEST_DEFAULT_OPERATIONS   400000
+#define TEST_DEFAULT_SEED         7
+#define TEST_MAX_ORDER            10               // MAX_ORDER, the default
+#define TEST_QUICK_LIST_LIMIT     32               // QUICK_LIST_LIMIT, the default
+#define TEST_PURGE_THRESHOLD      (16 << 20)       // PURGE_THRESHOLD, the default
+#define TEST_PURGE_BLOCKS         3000
+#define TEST_PURGE_SIZE           60000            // An order-9 block, under the mmap threshold
+
+
+//================ Allocator related start =============
+struct MallocStats{                               // Same layout as in malloc_3.cpp
+     size_t              free_blocks;
+     size_t              free_bytes;
+     size_t              allocated_blocks;
+     size_t              allocated_bytes;
+     size_t              meta_data_bytes;
+     size_t              size_meta_data;
+     size_t              mmap_blocks;
+     size_t              mmap_bytes;
+     size_t              dirty_bytes;
+     size_t              purged_bytes;
+     size_t              quick_blocks;
+     size_t              arenas;
+     size_t              splits;
+     size_t              merges;
+     size_t              free_per_order[TEST_MAX_ORDER + 1];
+     size_t              used_per_order[TEST_MAX_ORDER + 1];
+};
+
+void* smalloc(size_t size);
+void  sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t scheck_heap();
+size_t strim();
+void  _snapshot_stats(MallocStats* stats);
+//================= Allocator related end ==============
+
+//================== Test related start ================
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+MallocStats snapshot(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats;
+}
+
+bool quick_lists_bounded(){                       // At most QUICK_LIST_LIMIT blocks per order and arena
+     MallocStats stats = snapshot();
+     return stats.quick_blocks <= stats.arenas * (TEST_MAX_ORDER + 1) * TEST_QUICK_LIST_LIMIT;
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     long operations = argc >= 2 ? atol(argv[1]) : TEST_DEFAULT_OPERATIONS;
+     unsigned seed   = argc >= 3 ? atoi(argv[2]) : TEST_DEFAULT_SEED;
+     if( operations <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [operations] [seed]" << std::endl;
+          return 1;
+     }
+
+     std::mt19937 rng(seed);
+     std::vector<void*> live;
+     size_t problems = 0;
+     bool bounded = true;
+     for(long i = 0 ; i < operations ; ++i){
+          unsigned r = rng() % 100;
+          if( live.empty() || r < 50 ){
+               size_t size = rng() % 4 ? 100 + rng() % 900 : 100 + rng() % 60000;
+               void* p = smalloc(size);
+               if( p ){
+                    memset(p, 1, size);
+                    live.push_back(p);
+               }
+          }
+          else if( r < 90 ){
+               size_t k = rng() % live.size();
+               sfree(live[k]);
+               live[k] = live.back();
+               live.pop_back();
+          }
+          else{
+               size_t k = rng() % live.size();
+               void* p = srealloc(live[k], 100 + rng() % 3000);
+               if( p ){
+                    live[k] = p;
+               }
+          }
+          if( i % 20000 == 0 ){
+               problems += scheck_heap();
+               bounded = bounded && quick_lists_bounded();
+          }
+     }
+     problems += scheck_heap();
+     check(problems == 0, "scheck_heap quiet through the churn");
+     check(bounded, "quick lists stay within QUICK_LIST_LIMIT");
+     for(void* p : live){
+          sfree(p);
+     }
+     live.clear();
+     check(scheck_heap() == 0, "scheck_heap after freeing everything");
+     strim();
+     check(snapshot().quick_blocks == 0, "strim merges every quick list");
+
+     for(long i = 0 ; i < TEST_PURGE_BLOCKS ; ++i){   // Every second one freed, so no arena empties
+          void* p = smalloc(TEST_PURGE_SIZE);
+          if( !p ){
+               std::cerr << "smalloc(" << TEST_PURGE_SIZE << ") failed" << std::endl;
+               return failures + 1;
+          }
+          memset(p, 1, TEST_PURGE_SIZE);
+          live.push_back(p);
+     }
+     bool purged = true;
+     for(long i = 0 ; i < TEST_PURGE_BLOCKS ; i += 2){
+          sfree(live[i]);
+          purged = purged && snapshot().dirty_bytes <= TEST_PURGE_THRESHOLD;
+     }
+     check(purged, "dirty bytes never pass PURGE_THRESHOLD");
+     for(long i = 1 ; i < TEST_PURGE_BLOCKS ; i += 2){
+          sfree(live[i]);
+     }
+     strim();
+     check(snapshot().quick_blocks == 0 && scheck_heap() == 0, "strim after the purge leaves a clean heap");
+     return failures;
+}
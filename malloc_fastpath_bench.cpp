@@ -0,0 +1,107 @@
+
+// Measures what one malloc/free pair costs on the path the thread cache serves without a lock.
+// Two loops: a ring where every slot is freed and allocated again with one size, and a churn loop
+// that picks random slots and sizes, so slabs, several orders and the slow path all take part.
+//   g++ -std=c++11 -O2 malloc_fastpath_bench.cpp malloc_3.cpp -o fastpath_default -pthread
+//   g++ -std=c++11 -O2 -DTHREAD_CACHE=1 malloc_fastpath_bench.cpp malloc_3.cpp -o fastpath_tc -pthread
+//   ./fastpath_tc [ring iterations] [churn operations]
+// Cycles come from rdtsc, so they count reference cycles at the TSC rate, not core cycles.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#define BENCH_DEFAULT_ITERATIONS  20000000
+#define BENCH_DEFAULT_OPERATIONS  20000000
+#define BENCH_RING                64                  // Live blocks in the ring, twice a magazine
+#define BENCH_SLOTS               4096                // Slots the churn loop picks from
+#define BENCH_CHURN_MAX_SIZE      2048
+
+const size_t bench_sizes[] = {24, 64, 200, 500, 1000};   // Slab, slab, orders 1..3
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t scheck_heap();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void* ring[BENCH_RING];
+void* slots[BENCH_SLOTS];
+
+bool ring_pairs(size_t size, long iterations, double* ns, double* cycles){   // Per free + malloc pair
+     for(int i = 0 ; i < BENCH_RING ; ++i){
+          ring[i] = smalloc(size);
+     }
+     uint64_t start = monotonic_ns();
+     uint64_t start_cycles = __rdtsc();
+     for(long i = 0 ; i < iterations ; ++i){
+          void*& slot = ring[i & (BENCH_RING - 1)];
+          sfree(slot);
+          slot = smalloc(size);
+          if( !slot ){
+               return false;
+          }
+          *(volatile char*)slot = (char)i;        // Touch it, like a real caller would
+     }
+     *cycles = (double)(__rdtsc() - start_cycles) / iterations;
+     *ns     = (double)(monotonic_ns() - start) / iterations;
+     for(int i = 0 ; i < BENCH_RING ; ++i){
+          sfree(ring[i]);
+     }
+     return true;
+}
+
+double churn(long operations){                    // ns per malloc or free, an LCG keeps runs comparable
+     uint32_t x = 1;
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < operations ; ++i){
+          x = x * 1103515245 + 12345;
+          void*& slot = slots[(x >> 8) & (BENCH_SLOTS - 1)];
+          if( slot ){
+               sfree(slot);
+               slot = nullptr;
+          }
+          else{
+               slot = smalloc(((x >> 20) & (BENCH_CHURN_MAX_SIZE - 1)) + 1);
+          }
+     }
+     double ns = (double)(monotonic_ns() - start) / operations;
+     for(int i = 0 ; i < BENCH_SLOTS ; ++i){
+          sfree(slots[i]);
+          slots[i] = nullptr;
+     }
+     return ns;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long iterations = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+     long operations = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_OPERATIONS;
+     if( iterations <= 0 || operations <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [ring iterations] [churn operations]" << std::endl;
+          return 1;
+     }
+
+     for(size_t size : bench_sizes){
+          double ns, cycles;
+          ring_pairs(size, iterations / 100, &ns, &cycles);      // Warm up, fills the magazines
+          if( !ring_pairs(size, iterations, &ns, &cycles) ){
+               std::cerr << "smalloc(" << size << ") failed" << std::endl;
+               return 1;
+          }
+          printf("ring  size %-6zu %7.1f ns/pair %7.1f cycles/pair\n", size, ns, cycles);
+     }
+     printf("churn sizes 1..%-4d %7.1f ns/op\n", BENCH_CHURN_MAX_SIZE, churn(operations));
+     return scheck_heap() ? 1 : 0;
+}
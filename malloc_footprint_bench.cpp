@@ -0,0 +1,74 @@
+
+// Measures how many heap bytes a set of live allocations costs compared to what was asked for.
+// Footprint is the payload of used blocks plus their headers, divided by the requested bytes, so it
+// counts both header overhead and the rounding up to a buddy order or slab class.
+//   g++ -std=c++11 -O2 malloc_footprint_bench.cpp malloc_3.cpp -o footprint -pthread
+//   ./footprint [uniform|log] [allocations] [max size]
+// uniform draws sizes from 1..max size, log draws them log-uniformly, so small sizes dominate.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+#define BENCH_DEFAULT_ALLOCATIONS 20000
+#define BENCH_DEFAULT_UNIFORM_MAX 256
+#define BENCH_DEFAULT_LOG_MAX     8192
+#define BENCH_SEED                42
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+size_t draw_size(bool log_uniform, size_t max_size){
+     double u = (double)rand() / RAND_MAX;
+     if( log_uniform ){
+          size_t size = (size_t)exp(u * log((double)max_size));
+          return size ? size : 1;
+     }
+     return 1 + rand() % max_size;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     bool log_uniform  = argc >= 2 && !strcmp(argv[1], "log");
+     long allocations  = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_ALLOCATIONS;
+     long max_size     = argc >= 4 ? atol(argv[3]) : (log_uniform ? BENCH_DEFAULT_LOG_MAX : BENCH_DEFAULT_UNIFORM_MAX);
+     if( (argc >= 2 && strcmp(argv[1], "log") && strcmp(argv[1], "uniform")) || allocations <= 0 || max_size <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [uniform|log] [allocations] [max size]" << std::endl;
+          return 1;
+     }
+
+     srand(BENCH_SEED);
+     std::vector<void*> live;
+     size_t requested = 0;
+     for(long i = 0 ; i < allocations ; ++i){
+          size_t size = draw_size(log_uniform, max_size);
+          void* p = smalloc(size);
+          if( !p ){
+               std::cerr << "smalloc(" << size << ") failed" << std::endl;
+               return 1;
+          }
+          live.push_back(p);
+          requested += size;
+     }
+     size_t used_payload = _num_allocated_bytes() - _num_free_bytes();
+     size_t used_headers = _num_meta_data_bytes() - _num_free_blocks() * _size_meta_data();
+     printf("header %zu B, requested %zu B, used payload %zu B, used headers %zu B\n",
+            _size_meta_data(), requested, used_payload, used_headers);
+     printf("footprint / requested %.3f\n", (double)(used_payload + used_headers) / requested);
+     for(void* p : live){
+          sfree(p);
+     }
+     return 0;
+}
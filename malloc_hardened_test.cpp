@@ -0,0 +1,193 @@
+
+// Checks the MALLOC_HARDENED build of malloc_3: random traffic over every entry point passes
+// scheck_heap(), and each kind of bad free below aborts the process instead of corrupting the heap.
+//   g++ -std=c++11 -O2 -DMALLOC_HARDENED malloc_hardened_test.cpp malloc_3.cpp -o hardened_test -pthread
+//   g++ -std=c++11 -O2 -DMALLOC_HARDENED -DTHREAD_CACHE=1 -DDEFERRED_COALESCE=1 malloc_hardened_test.cpp malloc_3.cpp -o hardened_test_tc -pthread
+//   ./hardened_test [iterations] [seed]
+// Exits with the number of failed checks. Every bad free runs in a forked child that must die of
+// SIGABRT; its report on stderr is silenced. Without MALLOC_HARDENED most of them are missed.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <random>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_DEFAULT_ITERATIONS   200000
+#define TEST_DEFAULT_SEED         3
+#define TEST_BATCH                20
+#define TEST_HEADER_SIZE          8
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void  sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+void* smemalign(size_t alignment, size_t size);
+size_t smalloc_batch(size_t size, size_t count, void** out);
+void  sfree_batch(void** ptrs, size_t count);
+size_t scheck_heap();
+size_t strim();
+//================= Allocator related end ==============
+
+//================== Test related start ================
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+void check_aborts(void (*bad_free)(), const char* what){
+     fflush(stdout);
+     pid_t child = fork();
+     if( child == 0 ){
+          close(2);
+          bad_free();
+          _exit(0);
+     }
+     int status = 0;
+     waitpid(child, &status, 0);
+     check(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT, what);
+}
+
+char not_heap[64];
+
+void double_free(){
+     void* p = smalloc(500);
+     sfree(p);
+     sfree(p);
+}
+
+void double_free_slab(){
+     void* p = smalloc(20);
+     void* keep = smalloc(20);                    // Keeps the slab from being destroyed in between
+     (void)keep;
+     sfree(p);
+     sfree(p);
+}
+
+void interior_slab_pointer(){
+     char* p = (char*)smalloc(40);
+     sfree(p + 8);
+}
+
+void overwritten_header(){                        // What an overflow out of the block below leaves behind
+     char* p = (char*)smalloc(500);
+     memset(p - TEST_HEADER_SIZE, 0x41, TEST_HEADER_SIZE);
+     sfree(p);
+}
+
+void foreign_pointer(){
+     sfree(not_heap + 16);
+}
+
+void double_free_mmap(){
+     void* p = smalloc(1 << 20);
+     sfree(p);
+     sfree(p);
+}
+
+void copied_mmap_header(){                        // A valid header moved elsewhere must not pass
+     char* p = (char*)smalloc(1 << 20);
+     char* q = (char*)smalloc(1 << 20);
+     memcpy(q - TEST_HEADER_SIZE, p - TEST_HEADER_SIZE, TEST_HEADER_SIZE);
+     sfree(q);
+}
+
+void overwritten_aligned_alias(){
+     char* p = (char*)smemalign(256, 100);
+     ((long*)p)[-1] = 12345;
+     sfree(p);
+}
+
+size_t random_traffic(long iterations, unsigned seed){   // Problems scheck_heap() reported along the way
+     std::mt19937 rng(seed);
+     std::vector<void*> live;
+     size_t problems = 0;
+     for(long i = 0 ; i < iterations ; ++i){
+          unsigned op = rng() % 10;
+          if( op < 4 || live.empty() ){
+               size_t size = rng() % 3 ? rng() % 2000 + 1 : rng() % 300000 + 1;
+               void* p = op == 0 ? scalloc(1, size) : smalloc(size);
+               if( p ){
+                    memset(p, 1, size);
+                    live.push_back(p);
+               }
+          }
+          else if( op == 4 ){
+               void* p = smemalign(64 << (rng() % 6), rng() % 5000 + 1);
+               if( p ){
+                    live.push_back(p);
+               }
+          }
+          else if( op == 5 ){
+               size_t k = rng() % live.size();
+               void* p = srealloc(live[k], rng() % 9000 + 1);
+               if( p ){
+                    live[k] = p;
+               }
+          }
+          else if( op == 6 ){
+               void* batch[TEST_BATCH];
+               size_t got = smalloc_batch(rng() % 700 + 1, TEST_BATCH, batch);
+               live.insert(live.end(), batch, batch + got);
+          }
+          else if( op == 7 && live.size() > TEST_BATCH ){
+               void* batch[TEST_BATCH];
+               for(int k = 0 ; k < TEST_BATCH ; ++k){
+                    size_t j = rng() % live.size();
+                    batch[k] = live[j];
+                    live[j] = live.back();
+                    live.pop_back();
+               }
+               sfree_batch(batch, TEST_BATCH);
+          }
+          else{
+               size_t k = rng() % live.size();
+               sfree(live[k]);
+               live[k] = live.back();
+               live.pop_back();
+          }
+          if( i % 20000 == 0 ){
+               problems += scheck_heap();
+          }
+     }
+     strim();
+     problems += scheck_heap();
+     for(void* p : live){
+          sfree(p);
+     }
+     return problems + scheck_heap();
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     long iterations = argc >= 2 ? atol(argv[1]) : TEST_DEFAULT_ITERATIONS;
+     unsigned seed   = argc >= 3 ? atoi(argv[2]) : TEST_DEFAULT_SEED;
+     if( iterations <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [iterations] [seed]" << std::endl;
+          return 1;
+     }
+
+     check(random_traffic(iterations, seed) == 0, "scheck_heap quiet through random traffic");
+     check_aborts(double_free, "double free aborts");
+     check_aborts(double_free_slab, "double free of a slab object aborts");
+     check_aborts(interior_slab_pointer, "interior slab pointer aborts");
+     check_aborts(overwritten_header, "overwritten block header aborts");
+     check_aborts(foreign_pointer, "pointer outside the heap aborts");
+     check_aborts(double_free_mmap, "double free of an mmap block aborts");
+     check_aborts(copied_mmap_header, "copied mmap header aborts");
+     check_aborts(overwritten_aligned_alias, "overwritten aligned alias header aborts");
+
+     char* p = (char*)smalloc(500);               // Last, the heap stays corrupted
+     memset(p - TEST_HEADER_SIZE, 0x41, TEST_HEADER_SIZE);
+     fflush(stdout);
+     check(scheck_heap() > 0, "scheck_heap reports an overwritten header");
+     return failures;
+}
@@ -0,0 +1,55 @@
+
+// Measures a loop of large smalloc/sfree pairs, each one past the mmap threshold, so every pair is a
+// mapping taken and given back. Without a cache of freed mappings each pair costs an mmap, an munmap
+// and the page faults of a fresh mapping.
+//   g++ -std=c++11 -O2 malloc_mmap_bench.cpp malloc_3.cpp -o mmap_bench -pthread
+//   ./mmap_bench [iterations]
+// Sizes cycle through 200 KB .. 3.4 MB in 200 KB steps; only the first and last byte are touched.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_ITERATIONS  20000
+#define BENCH_SIZE_STEP           200000
+#define BENCH_SIZE_STEPS          17
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long iterations = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+     if( iterations <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [iterations]" << std::endl;
+          return 1;
+     }
+
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < iterations ; ++i){
+          size_t size = BENCH_SIZE_STEP + (i % BENCH_SIZE_STEPS) * BENCH_SIZE_STEP;
+          char* p = (char*)smalloc(size);
+          if( !p ){
+               std::cerr << "smalloc(" << size << ") failed" << std::endl;
+               return 1;
+          }
+          p[0]        = 1;
+          p[size - 1] = 2;
+          sfree(p);
+     }
+     double ms = (double)(monotonic_ns() - start) / 1000000;
+     printf("%ld pairs %8.1f ms %8.2f us/pair\n", iterations, ms, ms * 1000 / iterations);
+     return 0;
+}
@@ -0,0 +1,171 @@
+
+// Compares NUMA placements of the malloc_3 buddy heap: every thread is pinned to one CPU, allocates
+// a working set there and then streams over a working set, either its own or its neighbour's.
+//   g++ -std=c++11 -O2 -DNUMA_ARENAS=1 malloc_numa_bench.cpp malloc_3.cpp -o numa_local -pthread
+//   g++ -std=c++11 -O2 -DNUMA_ARENAS=2 malloc_numa_bench.cpp malloc_3.cpp -o numa_interleave -pthread
+//   ./numa_local [threads] [MiB per thread] [passes] [own|neighbour]
+// Add -DNUMA_SIMULATED_NODES=2 to try the per-node arenas on a single node box, the timings then
+// only show the bookkeeping cost.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define BENCH_BLOCK_SIZE      (64 * 1024)         // Buddy blocks, well under the mmap threshold
+#define BENCH_DEFAULT_MIB     64
+#define BENCH_DEFAULT_PASSES  8
+#define BENCH_PAGE_SIZE       4096
+#define BENCH_NODE_SAMPLES    64                  // Pages asked about per thread for the placement check
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE           (1 << 0)
+#define MPOL_F_ADDR           (1 << 1)
+#endif
+
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t scheck_heap();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+volatile uint64_t bench_sink;
+
+struct ThreadResult{
+     std::vector<char*>  blocks;
+     int                 cpu;
+     int                 node;                    // Where the thread runs, from getcpu()
+     size_t              local_pages;             // Sampled pages of its working set on that node
+     size_t              sampled_pages;
+     double              seconds;
+};
+
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+int page_node(void* p){                           // -1 when the kernel has no NUMA, or the page is not there
+     int node = -1;
+     if( syscall(SYS_get_mempolicy, &node, nullptr, 0, p, MPOL_F_NODE | MPOL_F_ADDR) != 0 ){
+          return -1;
+     }
+     return node;
+}
+
+void pin_to_cpu(int cpu){
+     cpu_set_t set;
+     CPU_ZERO(&set);
+     CPU_SET(cpu, &set);
+     pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void allocate_working_set(ThreadResult* result, int cpu, size_t bytes){
+     pin_to_cpu(cpu);
+     unsigned node = 0, current = 0;
+     getcpu(&current, &node);
+     result->cpu  = current;
+     result->node = node;
+     for(size_t done = 0 ; done < bytes ; done += BENCH_BLOCK_SIZE){
+          char* block = (char*)smalloc(BENCH_BLOCK_SIZE);
+          if( !block ){
+               break;
+          }
+          std::memset(block, 1, BENCH_BLOCK_SIZE);     // First touch happens here, on this CPU
+          result->blocks.push_back(block);
+     }
+}
+
+void check_placement(ThreadResult* result){
+     result->local_pages = result->sampled_pages = 0;
+     size_t step = std::max((size_t)1, result->blocks.size() / BENCH_NODE_SAMPLES);
+     for(size_t i = 0 ; i < result->blocks.size() ; i += step){
+          int node = page_node(result->blocks[i] + BENCH_PAGE_SIZE);
+          if( node >= 0 ){
+               result->sampled_pages++;
+               result->local_pages += (node == result->node);
+          }
+     }
+}
+
+void stream(ThreadResult* result, const ThreadResult* data, int cpu, int passes){
+     pin_to_cpu(cpu);
+     uint64_t sum = 0;
+     uint64_t start = monotonic_ns();
+     for(int pass = 0 ; pass < passes ; ++pass){
+          for(char* block : data->blocks){
+               uint64_t* words = (uint64_t*)block;
+               for(size_t i = 0 ; i < BENCH_BLOCK_SIZE / sizeof(uint64_t) ; ++i){
+                    sum += words[i];
+                    words[i] = sum;
+               }
+          }
+     }
+     result->seconds = (monotonic_ns() - start) / 1e9;
+     bench_sink = sum;                            // Keeps the loop from being optimized away
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     int threads   = argc >= 2 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+     size_t bytes  = (argc >= 3 ? strtoul(argv[2], nullptr, 10) : BENCH_DEFAULT_MIB) << 20;
+     int passes    = argc >= 4 ? atoi(argv[3]) : BENCH_DEFAULT_PASSES;
+     bool neighbour = argc >= 5 && !strcmp(argv[4], "neighbour");
+     int cpus      = (int)sysconf(_SC_NPROCESSORS_ONLN);
+     if( threads <= 0 || passes <= 0 || !bytes ){
+          std::cerr << "usage: " << argv[0] << " [threads] [MiB per thread] [passes] [own|neighbour]" << std::endl;
+          return 1;
+     }
+
+     std::vector<ThreadResult> results(threads);
+     std::vector<std::thread> workers;
+     for(int t = 0 ; t < threads ; ++t){
+          workers.emplace_back(allocate_working_set, &results[t], t % cpus, bytes);
+     }
+     for(std::thread& worker : workers){
+          worker.join();
+     }
+     workers.clear();
+
+     for(int t = 0 ; t < threads ; ++t){          // Neighbour mode reads what the next CPU allocated, local or not
+          const ThreadResult* data = &results[neighbour ? (t + 1) % threads : t];
+          workers.emplace_back(stream, &results[t], data, t % cpus, passes);
+     }
+     for(std::thread& worker : workers){
+          worker.join();
+     }
+
+     double total_bytes = 0, slowest = 0;
+     size_t local_pages = 0, sampled_pages = 0;
+     for(int t = 0 ; t < threads ; ++t){
+          check_placement(&results[t]);
+          total_bytes  += (double)results[t].blocks.size() * BENCH_BLOCK_SIZE * passes;
+          slowest       = std::max(slowest, results[t].seconds);
+          local_pages  += results[t].local_pages;
+          sampled_pages += results[t].sampled_pages;
+          printf("thread %-3d cpu %-3d node %d  %.2f GB/s  %zu/%zu sampled pages local\n", t, results[t].cpu, results[t].node,
+                 results[t].blocks.size() * (double)BENCH_BLOCK_SIZE * passes / results[t].seconds / 1e9,
+                 results[t].local_pages, results[t].sampled_pages);
+     }
+     printf("aggregate         %.2f GB/s (%s working sets)\n", total_bytes / slowest / 1e9, neighbour ? "neighbour" : "own");
+     printf("pages local       %zu of %zu sampled\n", local_pages, sampled_pages);
+
+     for(ThreadResult& result : results){
+          for(char* block : result.blocks){
+               sfree(block);
+          }
+     }
+     return scheck_heap() ? 1 : 0;
+}
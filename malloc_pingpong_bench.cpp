@@ -0,0 +1,75 @@
+
+// Allocates and frees one block of the same size over and over, the case where an eagerly coalescing
+// buddy heap merges a block all the way up on free and splits it all the way down again on malloc.
+//   g++ -std=c++11 -O2 malloc_pingpong_bench.cpp malloc_3.cpp -o pingpong_eager -pthread
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 malloc_pingpong_bench.cpp malloc_3.cpp -o pingpong_deferred -pthread
+//   ./pingpong_deferred [iterations] [live blocks]
+// Live blocks are allocated ahead of the loop and stay around, so the freed block has live neighbours
+// somewhere up the tree instead of a fully free arena.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_ITERATIONS  10000000
+#define BENCH_DEFAULT_LIVE        0
+
+const size_t bench_sizes[] = {24, 100, 400, 1000, 4000, 16000, 60000};   // Slab, orders 0..9
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t scheck_heap();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+double ping_pong(size_t size, long iterations){   // ns per malloc/free pair
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < iterations ; ++i){
+          void* p = smalloc(size);
+          if( !p ){
+               return -1;
+          }
+          *(volatile char*)p = (char)i;           // Touch it, like a real caller would
+          sfree(p);
+     }
+     return (double)(monotonic_ns() - start) / iterations;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long iterations = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+     long live       = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_LIVE;
+     if( iterations <= 0 || live < 0 ){
+          std::cerr << "usage: " << argv[0] << " [iterations] [live blocks]" << std::endl;
+          return 1;
+     }
+
+     std::vector<void*> kept;
+     for(long i = 0 ; i < live ; ++i){            // Mixed sizes, so live blocks pin several orders
+          kept.push_back(smalloc(bench_sizes[i % (sizeof(bench_sizes) / sizeof(bench_sizes[0]))]));
+     }
+     for(size_t size : bench_sizes){
+          ping_pong(size, iterations / 100);      // Warm up, the first split and the page faults are not the point
+          double ns = ping_pong(size, iterations);
+          if( ns < 0 ){
+               std::cerr << "smalloc(" << size << ") failed" << std::endl;
+               return 1;
+          }
+          printf("size %-6zu %7.1f ns/pair\n", size, ns);
+     }
+     for(void* p : kept){
+          sfree(p);
+     }
+     return scheck_heap() ? 1 : 0;
+}
@@ -0,0 +1,90 @@
+
+// Checks how much of the peak RSS malloc_3 hands back when half of the heap is freed in a pattern
+// that leaves no arena empty, so releasing whole arenas cannot help and only purging free pages can.
+//   g++ -std=c++11 -O2 malloc_purge_bench.cpp malloc_3.cpp -o purge_bench -pthread
+//   g++ -std=c++11 -O2 -DPURGE_THRESHOLD=0 malloc_purge_bench.cpp malloc_3.cpp -o purge_bench_strim_only -pthread
+//   ./purge_bench [blocks] [size]
+// Prints RSS after filling, after freeing every second block, after strim(), after refilling the
+// holes and after freeing everything. Exits 1 if a block lost its contents on the way.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_BLOCKS      3000
+#define BENCH_DEFAULT_SIZE        60000            // An order-9 buddy block, well under the mmap threshold
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t strim();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+long rss_kib(){
+     long pages = 0, resident = 0;
+     FILE* statm = fopen("/proc/self/statm", "r");
+     if( !statm ){
+          return -1;
+     }
+     if( fscanf(statm, "%ld %ld", &pages, &resident) != 2 ){
+          resident = -1;
+     }
+     fclose(statm);
+     return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void report(const char* what){
+     printf("%-22s %8ld KiB\n", what, rss_kib());
+}
+
+bool filled_with(void* p, size_t size, unsigned char value){
+     unsigned char* bytes = (unsigned char*)p;
+     return bytes[0] == value && bytes[size / 2] == value && bytes[size - 1] == value;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long blocks = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_BLOCKS;
+     long size   = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_SIZE;
+     if( blocks <= 0 || size <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [blocks] [size]" << std::endl;
+          return 1;
+     }
+
+     std::vector<void*> live(blocks);
+     for(long i = 0 ; i < blocks ; ++i){
+          if( !(live[i] = smalloc(size)) ){
+               std::cerr << "smalloc(" << size << ") failed" << std::endl;
+               return 1;
+          }
+          memset(live[i], 1, size);
+     }
+     report("peak");
+     for(long i = 0 ; i < blocks ; i += 2){       // Every arena keeps live blocks
+          sfree(live[i]);
+     }
+     report("every second freed");
+     size_t released = strim();
+     report("after strim");
+     printf("strim released %zu B\n", released);
+     for(long i = 0 ; i < blocks ; i += 2){
+          if( !(live[i] = smalloc(size)) ){
+               std::cerr << "smalloc(" << size << ") failed" << std::endl;
+               return 1;
+          }
+          memset(live[i], 2, size);
+     }
+     report("holes refilled");
+     bool intact = true;
+     for(long i = 0 ; i < blocks ; ++i){
+          intact = intact && filled_with(live[i], size, (i % 2) ? 1 : 2);
+          sfree(live[i]);
+     }
+     report("all freed");
+     return intact ? 0 : 1;
+}
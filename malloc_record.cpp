@@ -0,0 +1,321 @@
+
+// LD_PRELOAD recorder, writes every malloc/calloc/realloc/free of the host program as a trace.
+//   g++ -std=c++11 -O2 -shared -fPIC malloc_record.cpp -o malloc_record.so -ldl -pthread
+//   MALLOC_TRACE_FILE=out.trace LD_PRELOAD=./malloc_record.so ./program
+// Replay the result with malloc_replay.cpp.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include "malloc_trace.h"
+
+#define TRACE_BUFFER_RECORDS  4096                // Records kept in memory between write() calls
+#define TRACE_TABLE_BITS      22                  // Live pointer table holds up to 2^22 objects
+#define TRACE_TABLE_SIZE      (1UL << TRACE_TABLE_BITS)
+#define TRACE_BOOTSTRAP_SIZE  (64 * 1024)         // Serves dlsym's own allocations before we have the real ones
+#define TRACE_DEFAULT_FILE    "malloc.trace"
+#define TRACE_TLS             thread_local __attribute__((tls_model("initial-exec")))    // Must not allocate on first use
+
+
+
+//================ Struct related start ================
+struct TableEntry{                 // ptr -> object id, ptr == 0 marks an empty slot
+     uintptr_t ptr;
+     uint32_t id;
+};
+
+typedef void* (*malloc_fn)(size_t);
+typedef void* (*calloc_fn)(size_t, size_t);
+typedef void* (*realloc_fn)(void*, size_t);
+typedef void  (*free_fn)(void*);
+
+malloc_fn  real_malloc  = nullptr;
+calloc_fn  real_calloc  = nullptr;
+realloc_fn real_realloc = nullptr;
+free_fn    real_free    = nullptr;
+
+char bootstrap_buffer[TRACE_BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+size_t bootstrap_used = 0;
+
+pthread_mutex_t trace_lock     = PTHREAD_MUTEX_INITIALIZER;       // Guards everything below
+TableEntry* live_table         = nullptr;
+TraceRecord trace_buffer[TRACE_BUFFER_RECORDS];
+size_t trace_buffered          = 0;
+int trace_fd                   = -1;
+bool trace_disabled            = false;
+uint32_t next_object_id        = 0;
+uint64_t trace_start_ns        = 0;
+
+std::atomic<uint16_t> next_thread_id(0);
+TRACE_TLS int thread_index     = -1;
+TRACE_TLS bool in_recorder     = false;          // Our own allocations (dlsym, libc internals) are not traced
+//================= Struct related end =================
+
+//================= Setup related start ================
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void resolve_real_functions(){
+     in_recorder  = true;                         // dlsym may call calloc, that one goes to the bootstrap buffer
+     real_malloc  = (malloc_fn)dlsym(RTLD_NEXT, "malloc");
+     real_calloc  = (calloc_fn)dlsym(RTLD_NEXT, "calloc");
+     real_realloc = (realloc_fn)dlsym(RTLD_NEXT, "realloc");
+     real_free    = (free_fn)dlsym(RTLD_NEXT, "free");
+     in_recorder  = false;
+}
+
+void* bootstrap_alloc(size_t size){
+     size_t start = (bootstrap_used + 15) & ~(size_t)15;
+     if(start + size > TRACE_BOOTSTRAP_SIZE){
+          return nullptr;
+     }
+     bootstrap_used = start + size;
+     return bootstrap_buffer + start;             // Already zero, it lives in .bss and is never reused
+}
+
+bool is_bootstrap(void* p){
+     return (char*)p >= bootstrap_buffer && (char*)p < bootstrap_buffer + TRACE_BOOTSTRAP_SIZE;
+}
+
+bool open_trace(){                                // Called with trace_lock held
+     if(trace_fd >= 0 || trace_disabled){
+          return !trace_disabled;
+     }
+     const char* path = getenv("MALLOC_TRACE_FILE");
+     trace_fd = open(path ? path : TRACE_DEFAULT_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+     void* table = mmap(nullptr, TRACE_TABLE_SIZE * sizeof(TableEntry), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+     if(trace_fd < 0 || table == MAP_FAILED){
+          trace_disabled = true;
+          return false;
+     }
+     live_table = (TableEntry*)table;
+     TraceHeader header = {TRACE_MAGIC, TRACE_VERSION};
+     if(write(trace_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)){
+          trace_disabled = true;
+          return false;
+     }
+     trace_start_ns = monotonic_ns();
+     return true;
+}
+
+void flush_trace(){                               // Called with trace_lock held
+     size_t bytes = trace_buffered * sizeof(TraceRecord);
+     char* data   = (char*)trace_buffer;
+     while(bytes){
+          ssize_t written = write(trace_fd, data, bytes);
+          if(written <= 0){
+               trace_disabled = true;
+               break;
+          }
+          data  += written;
+          bytes -= written;
+     }
+     trace_buffered = 0;
+}
+
+__attribute__((destructor)) void close_trace(){
+     pthread_mutex_lock(&trace_lock);
+     if(trace_fd >= 0 && !trace_disabled){
+          flush_trace();
+     }
+     pthread_mutex_unlock(&trace_lock);
+}
+//================== Setup related end =================
+
+//================= Table related start ================
+size_t table_slot(uintptr_t ptr){                 // Fibonacci hashing, malloc pointers share their low bits
+     return (size_t)((ptr * 0x9E3779B97F4A7C15ULL) >> (64 - TRACE_TABLE_BITS));
+}
+
+bool table_insert(uintptr_t ptr, uint32_t id){
+     size_t slot = table_slot(ptr);
+     for(size_t probes = 0; probes < TRACE_TABLE_SIZE; probes++){
+          if(live_table[slot].ptr == 0 || live_table[slot].ptr == ptr){
+               live_table[slot].ptr = ptr;
+               live_table[slot].id  = id;
+               return true;
+          }
+          slot = (slot + 1) & (TRACE_TABLE_SIZE - 1);
+     }
+     return false;                                // Full, the object simply is not traced
+}
+
+bool table_remove(uintptr_t ptr, uint32_t* id){  // Backward shift deletion keeps probe chains intact
+     size_t slot = table_slot(ptr);
+     while(live_table[slot].ptr != ptr){
+          if(live_table[slot].ptr == 0){
+               return false;
+          }
+          slot = (slot + 1) & (TRACE_TABLE_SIZE - 1);
+     }
+     *id = live_table[slot].id;
+     size_t hole = slot;
+     while(true){
+          slot = (slot + 1) & (TRACE_TABLE_SIZE - 1);
+          if(live_table[slot].ptr == 0){
+               break;
+          }
+          size_t home = table_slot(live_table[slot].ptr);
+          if(((slot - home) & (TRACE_TABLE_SIZE - 1)) >= ((slot - hole) & (TRACE_TABLE_SIZE - 1))){
+               live_table[hole] = live_table[slot];
+               hole = slot;
+          }
+     }
+     live_table[hole].ptr = 0;
+     return true;
+}
+//================== Table related end =================
+
+//================ Record related start ================
+void append_record(uint8_t op, size_t size, uint32_t id){     // Called with trace_lock held
+     if(thread_index < 0){
+          thread_index = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+     }
+     TraceRecord& record = trace_buffer[trace_buffered++];
+     record.timestamp_ns = monotonic_ns() - trace_start_ns;
+     record.size         = (uint32_t)size;
+     record.id           = id;
+     record.thread       = (uint16_t)thread_index;
+     record.op           = op;
+     record.reserved     = 0;
+     if(trace_buffered == TRACE_BUFFER_RECORDS){
+          flush_trace();
+     }
+}
+
+void record_allocation(uint8_t op, void* p, size_t size){
+     if(!p || size > UINT32_MAX){
+          return;
+     }
+     pthread_mutex_lock(&trace_lock);
+     if(open_trace()){
+          uint32_t id = next_object_id;
+          if(table_insert((uintptr_t)p, id)){
+               next_object_id++;
+               append_record(op, size, id);
+          }
+     }
+     pthread_mutex_unlock(&trace_lock);
+}
+
+void record_free(void* p){
+     pthread_mutex_lock(&trace_lock);
+     uint32_t id;
+     if(open_trace() && table_remove((uintptr_t)p, &id)){
+          append_record(TRACE_FREE, 0, id);
+     }
+     pthread_mutex_unlock(&trace_lock);
+}
+
+void record_realloc(void* oldp, void* newp, size_t size){
+     pthread_mutex_lock(&trace_lock);
+     uint32_t id;
+     if(open_trace() && table_remove((uintptr_t)oldp, &id)){
+          if(size <= UINT32_MAX && table_insert((uintptr_t)newp, id)){
+               append_record(TRACE_REALLOC, size, id);
+          }
+          else{
+               append_record(TRACE_FREE, 0, id);  // We lost track of it, end the object here
+          }
+     }
+     pthread_mutex_unlock(&trace_lock);
+}
+//================= Record related end =================
+
+//=============== Interposition related start ==========
+extern "C" void* malloc(size_t size){
+     if(!real_malloc){
+          if(in_recorder){
+               return bootstrap_alloc(size);
+          }
+          resolve_real_functions();
+     }
+     void* p = real_malloc(size);
+     if(!in_recorder){
+          in_recorder = true;                     // write() and friends must not record themselves
+          record_allocation(TRACE_MALLOC, p, size);
+          in_recorder = false;
+     }
+     return p;
+}
+
+extern "C" void* calloc(size_t num, size_t size){
+     if(!real_calloc){
+          if(in_recorder){
+               if(size && num > SIZE_MAX / size){
+                    return nullptr;
+               }
+               return bootstrap_alloc(num * size);
+          }
+          resolve_real_functions();
+     }
+     void* p = real_calloc(num, size);
+     if(!in_recorder && p){
+          in_recorder = true;
+          record_allocation(TRACE_CALLOC, p, num * size);
+          in_recorder = false;
+     }
+     return p;
+}
+
+extern "C" void* realloc(void* oldp, size_t size){
+     if(!real_realloc){
+          if(in_recorder){
+               return bootstrap_alloc(size);      // Nothing calls realloc this early, keep it well defined anyway
+          }
+          resolve_real_functions();
+     }
+     if(oldp && is_bootstrap(oldp)){
+          void* p = malloc(size);
+          if(p){
+               size_t available = bootstrap_buffer + TRACE_BOOTSTRAP_SIZE - (char*)oldp;
+               memcpy(p, oldp, size < available ? size : available);
+          }
+          return p;
+     }
+     void* p = real_realloc(oldp, size);
+     if(!in_recorder){
+          in_recorder = true;
+          if(!oldp){
+               record_allocation(TRACE_MALLOC, p, size);
+          }
+          else if(p){
+               record_realloc(oldp, p, size);
+          }
+          else if(size == 0){
+               record_free(oldp);                 // glibc frees on realloc(p, 0)
+          }
+          in_recorder = false;
+     }
+     return p;
+}
+
+extern "C" void free(void* p){
+     if(!p || is_bootstrap(p)){
+          return;
+     }
+     if(!real_free){
+          resolve_real_functions();
+     }
+     if(!in_recorder){
+          in_recorder = true;
+          record_free(p);
+          in_recorder = false;
+     }
+     real_free(p);
+}
+//================ Interposition related end ===========
@@ -0,0 +1,340 @@
+
+// Replays a trace (see malloc_trace.h) against one of the allocators and reports throughput,
+// per-op latency percentiles, peak RSS and fragmentation.
+//   g++ -std=c++11 -O2 malloc_replay.cpp malloc_3.cpp -o replay_3 -pthread
+//   ./replay_3 run out.trace
+//   ./replay_3 gen producer-consumer|power-law|realloc-growth out.trace [ops] [seed]
+// Ops are replayed in trace order on one thread, so frees from other threads stay valid.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "malloc_trace.h"
+
+#define REPLAY_DEFAULT_OPS    1000000
+#define REPLAY_PAGE_STRIDE    4096                // Touch one byte per page so RSS follows the heap
+#define REPLAY_MAX_SIZE       100000000           // Same limit as MAX_SIZE_MALLOC_REQ
+
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);                       // Every malloc_N.cpp has this one
+void* scalloc(size_t num, size_t size)  __attribute__((weak));
+void  sfree(void* p)                    __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+size_t _num_free_bytes()                __attribute__((weak));
+size_t _num_allocated_bytes()           __attribute__((weak));
+size_t _num_meta_data_bytes()           __attribute__((weak));
+
+void* replay_calloc(size_t num, size_t size){     // malloc_1 only has smalloc, fill the gaps for it
+     if(scalloc){
+          return scalloc(num, size);
+     }
+     void* p = smalloc(num * size);
+     if(p){
+          std::memset(p, 0, num * size);
+     }
+     return p;
+}
+
+void* replay_realloc(void* oldp, size_t old_size, size_t size){
+     if(srealloc){
+          return srealloc(oldp, size);
+     }
+     void* p = smalloc(size);
+     if(p){
+          std::memcpy(p, oldp, std::min(old_size, size));
+          if(sfree){
+               sfree(oldp);
+          }
+     }
+     return p;
+}
+
+size_t heap_footprint(){                          // Bytes the allocator holds, payloads plus metadata
+     if(!_num_allocated_bytes || !_num_meta_data_bytes){
+          return 0;
+     }
+     return _num_allocated_bytes() + _num_meta_data_bytes();
+}
+//================= Allocator related end ==============
+
+//================== Trace related start ===============
+bool load_trace(const char* path, std::vector<TraceRecord>* records){
+     FILE* file = fopen(path, "rb");
+     if(!file){
+          perror(path);
+          return false;
+     }
+     TraceHeader header;
+     if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION){
+          std::cerr << path << ": not a version " << TRACE_VERSION << " allocation trace" << std::endl;
+          fclose(file);
+          return false;
+     }
+     TraceRecord record;
+     while(fread(&record, sizeof(record), 1, file) == 1){
+          records->push_back(record);
+     }
+     fclose(file);
+     return true;
+}
+
+bool save_trace(const char* path, const std::vector<TraceRecord>& records){
+     FILE* file = fopen(path, "wb");
+     if(!file){
+          perror(path);
+          return false;
+     }
+     TraceHeader header = {TRACE_MAGIC, TRACE_VERSION};
+     bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+               fwrite(records.data(), sizeof(TraceRecord), records.size(), file) == records.size();
+     ok = (fclose(file) == 0) && ok;
+     if(!ok){
+          perror(path);
+     }
+     return ok;
+}
+//=================== Trace related end ================
+
+//================ Generator related start =============
+struct TraceBuilder{
+     std::vector<TraceRecord> records;
+     uint32_t next_id = 0;
+
+     uint32_t add(uint8_t op, size_t size, uint32_t id, uint16_t thread){
+          TraceRecord record;
+          record.timestamp_ns = records.size();   // Synthetic traces only need the order
+          record.size         = (uint32_t)size;
+          record.id           = id;
+          record.thread       = thread;
+          record.op           = op;
+          record.reserved     = 0;
+          records.push_back(record);
+          return id;
+     }
+     uint32_t allocate(size_t size, uint16_t thread){
+          return add(TRACE_MALLOC, size, next_id++, thread);
+     }
+};
+
+size_t power_law_size(double alpha, size_t min_size, size_t max_size){       // Pareto, most requests are small
+     double u    = (rand() + 1.0) / (RAND_MAX + 2.0);
+     double size = min_size / std::pow(u, 1.0 / alpha);
+     return size > max_size ? max_size : (size_t)size;
+}
+
+void generate_producer_consumer(TraceBuilder* trace, size_t ops){   // Thread 0 allocates, thread 1 frees in FIFO order
+     std::deque<uint32_t> queue;
+     while(trace->records.size() < ops){
+          if(queue.empty() || (queue.size() < 4096 && rand() % 2)){
+               size_t size = 64 + rand() % 1024;
+               queue.push_back(trace->allocate(size, 0));
+          }
+          else{
+               trace->add(TRACE_FREE, 0, queue.front(), 1);
+               queue.pop_front();
+          }
+     }
+     for(uint32_t id : queue){
+          trace->add(TRACE_FREE, 0, id, 1);
+     }
+}
+
+void generate_power_law(TraceBuilder* trace, size_t ops){           // Pareto sizes, random lifetimes
+     std::vector<uint32_t> live;
+     while(trace->records.size() < ops){
+          if(live.empty() || (live.size() < 8192 && rand() % 100 < 55)){
+               size_t size = power_law_size(1.2, 8, 1 << 20);
+               uint8_t op  = rand() % 8 ? TRACE_MALLOC : TRACE_CALLOC;
+               live.push_back(trace->add(op, size, trace->next_id++, 0));
+          }
+          else{
+               size_t index = rand() % live.size();
+               trace->add(TRACE_FREE, 0, live[index], 0);
+               live[index] = live.back();
+               live.pop_back();
+          }
+     }
+     for(uint32_t id : live){
+          trace->add(TRACE_FREE, 0, id, 0);
+     }
+}
+
+void generate_realloc_growth(TraceBuilder* trace, size_t ops){      // Vectors that grow by 1.5x, then die
+     while(trace->records.size() < ops){
+          size_t size   = 16 + rand() % 64;
+          size_t target = power_law_size(1.0, 256, 4 << 20);
+          uint32_t id   = trace->allocate(size, 0);
+          while(size < target && trace->records.size() < ops){
+               size = size + size / 2;
+               trace->add(TRACE_REALLOC, size, id, 0);
+          }
+          trace->add(TRACE_FREE, 0, id, 0);
+     }
+}
+//================= Generator related end ==============
+
+//================== Replay related start ==============
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void touch(void* p, size_t size){
+     for(size_t offset = 0; offset < size; offset += REPLAY_PAGE_STRIDE){
+          ((volatile char*)p)[offset] = 1;
+     }
+}
+
+uint64_t percentile(const std::vector<uint32_t>& sorted, double fraction){
+     if(sorted.empty()){
+          return 0;
+     }
+     size_t index = (size_t)(fraction * (sorted.size() - 1));
+     return sorted[index];
+}
+
+int replay(const std::vector<TraceRecord>& records){
+     uint32_t max_id = 0;
+     for(const TraceRecord& record : records){
+          max_id = std::max(max_id, record.id);
+     }
+     std::vector<void*>  objects(records.empty() ? 0 : (size_t)max_id + 1, nullptr);
+     std::vector<size_t> sizes(objects.size(), 0);
+     std::vector<uint32_t> latencies;
+     latencies.reserve(records.size());
+
+     size_t live_bytes      = 0;
+     size_t peak_live_bytes = 0;
+     size_t peak_footprint  = 0;
+     size_t failed          = 0;
+     size_t skipped         = 0;
+     uint64_t total_ns      = 0;
+
+     for(const TraceRecord& record : records){
+          void*& object = objects[record.id];
+          size_t size   = record.size;
+          void* result  = nullptr;
+          uint64_t start, end;
+
+          switch(record.op){
+          case TRACE_MALLOC:
+          case TRACE_CALLOC:
+               if(object || size == 0 || size > REPLAY_MAX_SIZE){
+                    skipped++;
+                    continue;
+               }
+               start  = monotonic_ns();
+               result = record.op == TRACE_MALLOC ? smalloc(size) : replay_calloc(1, size);
+               end    = monotonic_ns();
+               break;
+          case TRACE_REALLOC:
+               if(!object || size == 0 || size > REPLAY_MAX_SIZE){
+                    skipped++;
+                    continue;
+               }
+               start  = monotonic_ns();
+               result = replay_realloc(object, sizes[record.id], size);
+               end    = monotonic_ns();
+               break;
+          case TRACE_FREE:
+               if(!object){
+                    skipped++;
+                    continue;
+               }
+               start = monotonic_ns();
+               if(sfree){
+                    sfree(object);
+               }
+               end   = monotonic_ns();
+               live_bytes      -= sizes[record.id];
+               object           = nullptr;
+               sizes[record.id] = 0;
+               latencies.push_back((uint32_t)std::min<uint64_t>(end - start, UINT32_MAX));
+               total_ns += end - start;
+               continue;
+          default:
+               skipped++;
+               continue;
+          }
+
+          latencies.push_back((uint32_t)std::min<uint64_t>(end - start, UINT32_MAX));
+          total_ns += end - start;
+          if(!result){
+               failed++;                          // A failed realloc leaves the old object alive
+               continue;
+          }
+          live_bytes      += size - sizes[record.id];
+          object           = result;
+          sizes[record.id] = size;
+          touch(result, size);
+          if(live_bytes > peak_live_bytes){
+               peak_live_bytes = live_bytes;
+               peak_footprint  = heap_footprint();
+          }
+     }
+
+     struct rusage usage;
+     getrusage(RUSAGE_SELF, &usage);
+     std::sort(latencies.begin(), latencies.end());
+     double seconds = total_ns / 1e9;
+
+     printf("ops               %zu (skipped %zu, failed %zu)\n", latencies.size(), skipped, failed);
+     printf("time in allocator %.3f s\n", seconds);
+     printf("ops/sec           %.0f\n", seconds > 0 ? latencies.size() / seconds : 0.0);
+     printf("latency ns        p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+            (unsigned long)percentile(latencies, 0.50), (unsigned long)percentile(latencies, 0.90),
+            (unsigned long)percentile(latencies, 0.99), (unsigned long)percentile(latencies, 0.999),
+            (unsigned long)percentile(latencies, 1.0));
+     printf("peak RSS          %ld KiB\n", usage.ru_maxrss);
+     printf("peak live bytes   %zu\n", peak_live_bytes);
+     if(_num_allocated_bytes && _num_meta_data_bytes && peak_live_bytes){
+          printf("heap at peak      %zu (%.3f x live)\n", peak_footprint, (double)peak_footprint / peak_live_bytes);
+          printf("heap at end       %zu (%zu free)\n", heap_footprint(), _num_free_bytes ? _num_free_bytes() : 0);
+     }
+     return 0;
+}
+//=================== Replay related end ===============
+
+int main(int argc, char** argv){
+     if(argc >= 3 && !strcmp(argv[1], "run")){
+          std::vector<TraceRecord> records;
+          if(!load_trace(argv[2], &records)){
+               return 1;
+          }
+          return replay(records);
+     }
+     if(argc >= 4 && !strcmp(argv[1], "gen")){
+          size_t ops = argc >= 5 ? strtoul(argv[4], nullptr, 10) : REPLAY_DEFAULT_OPS;
+          srand(argc >= 6 ? atoi(argv[5]) : 1);
+          TraceBuilder trace;
+          if(!strcmp(argv[2], "producer-consumer")){
+               generate_producer_consumer(&trace, ops);
+          }
+          else if(!strcmp(argv[2], "power-law")){
+               generate_power_law(&trace, ops);
+          }
+          else if(!strcmp(argv[2], "realloc-growth")){
+               generate_realloc_growth(&trace, ops);
+          }
+          else{
+               std::cerr << "unknown generator " << argv[2] << std::endl;
+               return 1;
+          }
+          return save_trace(argv[3], trace.records) ? 0 : 1;
+     }
+     std::cerr << "usage: " << argv[0] << " run <trace>" << std::endl;
+     std::cerr << "       " << argv[0] << " gen producer-consumer|power-law|realloc-growth <trace> [ops] [seed]" << std::endl;
+     return 1;
+}
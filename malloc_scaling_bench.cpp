@@ -0,0 +1,103 @@
+
+// Measures how malloc_3 throughput scales with threads: 1, 2, 4 ... up to a maximum, each thread
+// churning its own ring of blocks, so the only thing threads share is the allocator itself.
+//   g++ -std=c++11 -O2 malloc_scaling_bench.cpp malloc_3.cpp -o scaling_locked -pthread
+//   g++ -std=c++11 -O2 -DTHREAD_CACHE=1 malloc_scaling_bench.cpp malloc_3.cpp -o scaling_tc -pthread
+//   ./scaling_tc [max threads] [operations per thread] [max size]
+// Every operation frees one ring slot and allocates it again. Sizes are drawn from 1..max size by a
+// per-thread LCG, so with the default 1024 most requests are buddy blocks of orders 0..3 and the rest
+// slab objects. Threads start together on a barrier and the slowest one sets the aggregate rate.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BENCH_DEFAULT_MAX_THREADS 64
+#define BENCH_DEFAULT_OPERATIONS  2000000
+#define BENCH_DEFAULT_MAX_SIZE    1024
+#define BENCH_RING                256                 // Live blocks per thread
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t scheck_heap();
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+pthread_barrier_t bench_start;
+
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void churn(int id, long operations, size_t max_size, double* seconds, bool* failed){
+     void* ring[BENCH_RING] = {nullptr};
+     uint32_t x = 2654435761u * (id + 1);
+     pthread_barrier_wait(&bench_start);
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < operations ; ++i){
+          x = x * 1103515245 + 12345;
+          void*& slot = ring[i % BENCH_RING];
+          sfree(slot);
+          if( !(slot = smalloc((x >> 8) % max_size + 1)) ){
+               *failed = true;
+               break;
+          }
+          *(volatile char*)slot = (char)i;        // Touch it, like a real caller would
+     }
+     *seconds = (monotonic_ns() - start) / 1e9;
+     for(void* p : ring){
+          sfree(p);
+     }
+}
+
+bool run(int threads, long operations, size_t max_size){
+     std::vector<double> seconds(threads, 0);
+     std::vector<char> failed(threads, false);
+     std::vector<std::thread> workers;
+     pthread_barrier_init(&bench_start, nullptr, threads);
+     for(int t = 0 ; t < threads ; ++t){
+          workers.emplace_back(churn, t, operations, max_size, &seconds[t], (bool*)&failed[t]);
+     }
+     for(std::thread& worker : workers){
+          worker.join();
+     }
+     pthread_barrier_destroy(&bench_start);
+     if( std::find(failed.begin(), failed.end(), true) != failed.end() ){
+          return false;
+     }
+     double slowest = *std::max_element(seconds.begin(), seconds.end());
+     double total   = (double)threads * operations;
+     printf("threads %-3d %8.2f Mops/s %8.1f ns/op per thread\n", threads, total / slowest / 1e6, slowest * 1e9 / operations);
+     return true;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     int max_threads  = argc >= 2 ? atoi(argv[1]) : BENCH_DEFAULT_MAX_THREADS;
+     long operations  = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_OPERATIONS;
+     long max_size    = argc >= 4 ? atol(argv[3]) : BENCH_DEFAULT_MAX_SIZE;
+     if( max_threads <= 0 || operations <= 0 || max_size <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [max threads] [operations per thread] [max size]" << std::endl;
+          return 1;
+     }
+
+     printf("%ld CPUs online, %ld ops per thread, sizes 1..%ld\n", sysconf(_SC_NPROCESSORS_ONLN), operations, max_size);
+     for(int threads = 1 ; threads <= max_threads ; threads *= 2){
+          if( !run(threads, operations, max_size) ){
+               std::cerr << "smalloc failed with " << threads << " threads" << std::endl;
+               return 1;
+          }
+     }
+     return scheck_heap() ? 1 : 0;
+}
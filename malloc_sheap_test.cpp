@@ -0,0 +1,185 @@
+
+// Checks the file backed heap of malloc_3 (sheap_open and friends): size limits, a second owner,
+// a clean reopen, and a reopen after the owner died with the heap still open.
+//   g++ -std=c++11 -O2 malloc_sheap_test.cpp malloc_3.cpp -o sheap_test -pthread
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 malloc_sheap_test.cpp malloc_3.cpp -o sheap_test_deferred -pthread
+//   ./sheap_test [heap file] [nodes]
+// Exits with the number of failed checks. The heap file is created (1 GiB, sparse) and removed again.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TEST_DEFAULT_PATH     "/tmp/malloc_sheap_test.heap"
+#define TEST_DEFAULT_NODES    100000
+#define TEST_TOP_BLOCK        ((size_t)128 << 14)     // ZERO_ORDER_BLOCK_SIZE << PERSISTENT_MAX_ORDER, the defaults
+#define TEST_HEADER_SIZE      8
+
+
+//================ Allocator related start =============
+struct PersistentHeap;
+PersistentHeap* sheap_open(const char* path);
+int   sheap_close(PersistentHeap* h);
+void* sheap_malloc(PersistentHeap* h, size_t size);
+void  sheap_free(PersistentHeap* h, void* p);
+void  sheap_set_root(PersistentHeap* h, void* p);
+void* sheap_root(PersistentHeap* h);
+bool  sheap_moved(PersistentHeap* h);
+bool  sheap_recovered(PersistentHeap* h);
+//================= Allocator related end ==============
+
+//================== Test related start ================
+struct Node{                                      // Linked by region offsets, so a moved heap still walks
+     int64_t             next;                    // From the root node, 0 ends the list
+     int64_t             value;
+};
+
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+Node* node_at(Node* root, int64_t offset){
+     return (Node*)((char*)root + offset);
+}
+
+Node* build_list(PersistentHeap* h, long nodes){  // Mixed sizes and frees in between, so the free lists are not trivial
+     Node* root = (Node*)sheap_malloc(h, sizeof(Node));
+     if( !root ){
+          return nullptr;
+     }
+     root -> next  = 0;
+     root -> value = -1;
+     Node* last = root;
+     for(long i=0 ; i<nodes ; ++i){
+          Node* node = (Node*)sheap_malloc(h, sizeof(Node) + (i % 9) * 300);
+          if( !node ){
+               return nullptr;
+          }
+          node -> next  = 0;
+          node -> value = i;
+          last -> next  = (char*)node - (char*)root;
+          last = node;
+          if( i % 3 == 0 ){
+               sheap_free(h, sheap_malloc(h, 100 + (i % 5) * 1000));
+          }
+     }
+     sheap_set_root(h, root);
+     return root;
+}
+
+long walk_list(Node* root){                       // Nodes in order, -1 on a wrong value
+     long count = 0;
+     for(Node* node = root ; ; node = node_at(root, node->next)){
+          if( node->value != count - 1 ){
+               return -1;
+          }
+          count++;
+          if( !node->next ){
+               return count;
+          }
+     }
+}
+
+void free_list(PersistentHeap* h, Node* root){
+     Node* node = root;
+     while( node ){
+          Node* next = node->next ? node_at(root, node->next) : nullptr;
+          sheap_free(h, node);
+          node = next;
+     }
+     sheap_set_root(h, nullptr);
+}
+
+long count_top_blocks(PersistentHeap* h){         // Takes every top block there is and gives them back
+     const long limit = 1 << 16;
+     static void* blocks[1 << 16];
+     long count = 0;
+     while( count < limit && (blocks[count] = sheap_malloc(h, TEST_TOP_BLOCK - TEST_HEADER_SIZE)) ){
+          count++;
+     }
+     for(long i=0 ; i<count ; ++i){
+          sheap_free(h, blocks[i]);
+     }
+     return count;
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     const char* path = argc >= 2 ? argv[1] : TEST_DEFAULT_PATH;
+     long nodes       = argc >= 3 ? atol(argv[2]) : TEST_DEFAULT_NODES;
+     if( nodes <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [heap file] [nodes]" << std::endl;
+          return 1;
+     }
+     unlink(path);
+
+     PersistentHeap* h = sheap_open(path);
+     if( !h ){
+          perror("sheap_open");
+          return 1;
+     }
+     check(!sheap_malloc(h, SIZE_MAX), "sheap_malloc(SIZE_MAX) fails");
+     check(!sheap_malloc(h, SIZE_MAX - 7), "sheap_malloc(SIZE_MAX - 7) fails");
+     check(!sheap_malloc(h, TEST_TOP_BLOCK - TEST_HEADER_SIZE + 1), "one byte over a top block fails");
+     void* top = sheap_malloc(h, TEST_TOP_BLOCK - TEST_HEADER_SIZE);
+     check(top && !((uintptr_t)((char*)top - TEST_HEADER_SIZE) & (TEST_TOP_BLOCK - 1)), "a whole top block works");
+     sheap_free(h, top);
+     long empty_top_blocks = count_top_blocks(h);
+     check(empty_top_blocks > 0, "an empty heap hands out top blocks");
+
+     errno = 0;
+     check(!sheap_open(path) && errno == EBUSY, "a second open of a live heap is refused");
+
+     Node* root = build_list(h, nodes);
+     check(root != nullptr, "list built");
+     sheap_close(h);
+     h = sheap_open(path);
+     check(h && !sheap_recovered(h), "clean reopen needs no recovery");
+     check(h && walk_list((Node*)sheap_root(h)) == nodes + 1, "list intact after a clean reopen");
+     if( h ){
+          sheap_close(h);
+     }
+
+     pid_t child = fork();
+     if( child == 0 ){                            // Grows the list further and dies with the heap open
+          PersistentHeap* owner = sheap_open(path);
+          if( !owner ){
+               _exit(2);
+          }
+          free_list(owner, (Node*)sheap_root(owner));
+          build_list(owner, nodes);
+          for(int i=0 ; i<1000 ; ++i){            // Left on the quick lists in deferred builds
+               sheap_free(owner, sheap_malloc(owner, 200 + i));
+          }
+          _exit(0);
+     }
+     int status = 0;
+     waitpid(child, &status, 0);
+     check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "owner ran and died without sheap_close");
+
+     h = sheap_open(path);
+     check(h && sheap_recovered(h), "reopen after the crash recovers");
+     if( h ){
+          root = (Node*)sheap_root(h);
+          check(walk_list(root) == nodes + 1, "list intact after recovery");
+          free_list(h, root);
+          check(count_top_blocks(h) == empty_top_blocks, "freeing everything merges back to top blocks");
+          sheap_close(h);
+     }
+     h = sheap_open(path);
+     check(h && !sheap_recovered(h), "a recovered heap closes cleanly");
+     if( h ){
+          sheap_close(h);
+     }
+
+     unlink(path);
+     return failures;
+}
@@ -0,0 +1,110 @@
+
+// Churns every slab size of malloc_3, 8-byte objects included, and checks where the objects land: 8-byte
+// aligned, never twice at once, and never at the one offset of a 128-byte line where sfree's fast path
+// expects a buddy payload. Every object keeps its value until freed, also across srealloc.
+//   g++ -std=c++11 -O2 malloc_slab_test.cpp malloc_3.cpp -o slab_test -pthread
+//   g++ -std=c++11 -O2 -DTHREAD_CACHE=1 malloc_slab_test.cpp malloc_3.cpp -o slab_test_tc -pthread
+//   g++ -std=c++11 -O2 -DMALLOC_HARDENED malloc_slab_test.cpp malloc_3.cpp -o slab_test_hardened -pthread
+//   ./slab_test [objects] [rounds]
+// Exits with the number of failed checks. Not for the MALLOC_INTERPOSE build, which has no 8-byte class.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdint.h>
+
+#define TEST_DEFAULT_OBJECTS      20000
+#define TEST_DEFAULT_ROUNDS       3
+#define TEST_SLAB_MAX_SIZE        96               // SLAB_MAX_SIZE, the default
+#define TEST_LINE                 128              // ZERO_ORDER_BLOCK_SIZE, the default
+#define TEST_PAYLOAD_OFFSET       8                // Where a buddy payload starts in its line
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t scheck_heap();
+size_t _num_free_blocks();
+size_t _num_allocated_blocks();
+//================= Allocator related end ==============
+
+//================== Test related start ================
+struct Object{
+     char*               p;
+     size_t              size;
+};
+
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+void put(const Object& object, long value){       // As many bytes of value as fit
+     memcpy(object.p, &value, std::min(object.size, sizeof(value)));
+}
+
+bool holds(const Object& object, long value){
+     return !memcmp(object.p, &value, std::min(object.size, sizeof(value)));
+}
+
+size_t object_size(long i){                       // Half of them 1..8 bytes, the rest spread over every slab size
+     return i % 2 ? 1 + i % 8 : 1 + i % TEST_SLAB_MAX_SIZE;
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     long objects = argc >= 2 ? atol(argv[1]) : TEST_DEFAULT_OBJECTS;
+     long rounds  = argc >= 3 ? atol(argv[2]) : TEST_DEFAULT_ROUNDS;
+     if( objects <= 0 || rounds <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [objects] [rounds]" << std::endl;
+          return 1;
+     }
+
+     size_t used_before = _num_allocated_blocks() - _num_free_blocks();
+     bool placed = true, unique = true, kept = true, moved = true;
+     for(long round = 0 ; round < rounds ; ++round){
+          std::vector<Object> live(objects);
+          std::set<uintptr_t> seen;
+          for(long i = 0 ; i < objects ; ++i){
+               live[i].size = object_size(i);
+               live[i].p    = (char*)smalloc(live[i].size);
+               uintptr_t address = (uintptr_t)live[i].p;
+               placed = placed && address && !(address & 7) && (address & (TEST_LINE - 1)) != TEST_PAYLOAD_OFFSET;
+               unique = unique && seen.insert(address).second;
+               if( !address ){
+                    return failures + 1;
+               }
+               put(live[i], i);
+          }
+          for(long i = 0 ; i < objects ; ++i){
+               kept = kept && holds(live[i], i);
+          }
+          for(long i = 0 ; i < objects ; i += 2){
+               sfree(live[i].p);
+          }
+          for(long i = 1 ; i < objects ; i += 2){   // Into another slab size, or out of the slabs
+               size_t size = 8 + (i % 3) * 40;
+               char* p = (char*)srealloc(live[i].p, size);
+               moved = moved && p && holds(Object{p, std::min(size, live[i].size)}, i);
+               live[i].p    = p;
+               live[i].size = size;
+          }
+          for(long i = 1 ; i < objects ; i += 2){
+               sfree(live[i].p);
+          }
+     }
+     check(placed, "objects are 8-aligned and off the buddy payload slot");
+     check(unique, "no object is handed out twice");
+     check(kept, "every object kept its value");
+     check(moved, "srealloc kept the value");
+     check(_num_allocated_blocks() - _num_free_blocks() == used_before, "freeing everything leaves no block in use");
+     check(scheck_heap() == 0, "scheck_heap after the churn");
+     return failures;
+}
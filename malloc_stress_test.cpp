@@ -0,0 +1,260 @@
+
+// Random smalloc / scalloc / srealloc / sfree churn against malloc_3 that checks every block keeps its
+// contents: first on one thread, then on several threads that also free each other's blocks, and last
+// that freeing a heap of about 60 arenas, in reverse or shuffled order, gives the empty arenas back.
+//   g++ -std=c++11 -O2 malloc_stress_test.cpp malloc_3.cpp -o stress_test -pthread
+//   g++ -std=c++11 -O2 -DTHREAD_CACHE=1 malloc_stress_test.cpp malloc_3.cpp -o stress_test_tc -pthread
+//   g++ -std=c++11 -O2 -DDEFERRED_COALESCE=1 -DMALLOC_DEBUG malloc_stress_test.cpp malloc_3.cpp -o stress_test_debug -pthread
+//   ./stress_test [operations] [threads] [seed]
+// Exits with the number of failed checks. scheck_heap() runs after every phase.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <stdint.h>
+
+#define TEST_DEFAULT_OPERATIONS   200000
+#define TEST_DEFAULT_THREADS      8
+#define TEST_DEFAULT_SEED         1
+#define TEST_MAX_ORDER            10               // MAX_ORDER, the default
+#define TEST_ARENAS_KEPT          1                // ARENA_FREE_HIGH_WATER, the default
+#define TEST_RELEASE_ROUNDS       20
+#define TEST_RELEASE_BLOCKS       6000             // Up to 60 KB each, about 60 arenas
+
+
+//================ Allocator related start =============
+struct MallocStats{                               // Same layout as in malloc_3.cpp
+     size_t              free_blocks;
+     size_t              free_bytes;
+     size_t              allocated_blocks;
+     size_t              allocated_bytes;
+     size_t              meta_data_bytes;
+     size_t              size_meta_data;
+     size_t              mmap_blocks;
+     size_t              mmap_bytes;
+     size_t              dirty_bytes;
+     size_t              purged_bytes;
+     size_t              quick_blocks;
+     size_t              arenas;
+     size_t              splits;
+     size_t              merges;
+     size_t              free_per_order[TEST_MAX_ORDER + 1];
+     size_t              used_per_order[TEST_MAX_ORDER + 1];
+};
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void  sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t scheck_heap();
+void  _snapshot_stats(MallocStats* stats);
+//================= Allocator related end ==============
+
+//================== Test related start ================
+struct Block{
+     unsigned char*      p;
+     size_t              size;
+     unsigned char       fill;
+};
+
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+bool filled_with(const unsigned char* p, size_t size, unsigned char value){
+     for(size_t k = 0 ; k < size ; k += size > 1000 ? 97 : 1){   // Sampled on big blocks, the last byte always
+          if( p[k] != value ){
+               return false;
+          }
+     }
+     return p[size - 1] == value;
+}
+
+size_t random_size(std::mt19937& rng){            // Mostly slab and small buddy sizes, a few mmap blocks
+     unsigned r = rng() % 100;
+     if( r < 60 ){
+          return 1 + rng() % 64;
+     }
+     if( r < 90 ){
+          return 1 + rng() % 4000;
+     }
+     if( r < 98 ){
+          return 1 + rng() % 100000;
+     }
+     return 100000 + rng() % 400000;
+}
+
+bool churn(long operations, unsigned seed){       // false on the first block that lost its contents
+     std::mt19937 rng(seed);
+     std::vector<Block> live;
+     bool intact = true;
+     for(long i = 0 ; i < operations && intact ; ++i){
+          unsigned op = rng() % 10;
+          if( op < 5 || live.empty() ){
+               size_t size = random_size(rng);
+               unsigned char* p = (unsigned char*)(rng() % 4 ? smalloc(size) : scalloc(1, size));
+               if( !p ){
+                    continue;
+               }
+               intact = !((uintptr_t)p & 7);
+               Block block = {p, size, (unsigned char)rng()};
+               memset(p, block.fill, size);
+               live.push_back(block);
+          }
+          else if( op < 8 ){
+               size_t k = rng() % live.size();
+               intact = filled_with(live[k].p, live[k].size, live[k].fill);
+               sfree(live[k].p);
+               live[k] = live.back();
+               live.pop_back();
+          }
+          else{
+               Block& block = live[rng() % live.size()];
+               unsigned r = rng() % 100;
+               size_t size = r < 50 ? 1 + rng() % (2 * block.size + 10) : r < 90 ? 1 + rng() % 8000 : 1 + rng() % 300000;
+               unsigned char* p = (unsigned char*)srealloc(block.p, size);
+               if( !p ){
+                    continue;
+               }
+               intact = filled_with(p, std::min(size, block.size), block.fill);
+               block.p    = p;
+               block.size = size;
+               memset(p, block.fill, size);
+          }
+     }
+     for(Block& block : live){
+          sfree(block.p);
+     }
+     return intact;
+}
+
+std::mutex handoff_lock;
+std::vector<void*> handoff;                       // Blocks one thread left for any other to free
+
+void threaded_churn(int id, long operations, bool* intact){
+     std::mt19937 rng(id);
+     std::vector<Block> live;
+     unsigned char fill = (unsigned char)id;
+     for(long i = 0 ; i < operations ; ++i){
+          unsigned r = rng();
+          if( r % 3 || live.empty() ){
+               size_t size = 1 + (r % 7 == 0 ? r % 200000 : r % 900);
+               unsigned char* p = (unsigned char*)smalloc(size);
+               if( p ){
+                    memset(p, fill, size);
+                    Block block = {p, size, fill};
+                    live.push_back(block);
+               }
+          }
+          else{
+               size_t k = r % live.size();
+               Block block = live[k];
+               live[k] = live.back();
+               live.pop_back();
+               *intact = *intact && filled_with(block.p, block.size, fill);
+               if( r % 5 == 0 ){
+                    std::lock_guard<std::mutex> guard(handoff_lock);
+                    handoff.push_back(block.p);
+               }
+               else if( r % 5 == 1 ){
+                    unsigned char* p = (unsigned char*)srealloc(block.p, block.size * 2 + 1);
+                    if( !p ){
+                         sfree(block.p);
+                         continue;
+                    }
+                    *intact = *intact && filled_with(p, block.size, fill);
+                    block.p     = p;
+                    block.size  = block.size * 2 + 1;
+                    memset(p, fill, block.size);
+                    live.push_back(block);
+               }
+               else{
+                    sfree(block.p);
+               }
+          }
+          if( i % 100 == 0 ){
+               std::lock_guard<std::mutex> guard(handoff_lock);
+               for(void* p : handoff){
+                    sfree(p);
+               }
+               handoff.clear();
+          }
+     }
+     for(Block& block : live){
+          sfree(block.p);
+     }
+}
+
+size_t arenas(){
+     MallocStats stats;
+     _snapshot_stats(&stats);
+     return stats.arenas;
+}
+
+void release_round(int round){                    // On its own thread, so a thread cache goes back when it exits
+     std::mt19937 rng(round);
+     std::vector<void*> blocks;
+     for(long i = 0 ; i < TEST_RELEASE_BLOCKS ; ++i){
+          blocks.push_back(smalloc(100 + rng() % 60000));
+     }
+     if( round % 2 ){
+          std::shuffle(blocks.begin(), blocks.end(), rng);
+     }
+     else{
+          std::reverse(blocks.begin(), blocks.end());
+     }
+     for(void* p : blocks){
+          sfree(p);
+     }
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     long operations = argc >= 2 ? atol(argv[1]) : TEST_DEFAULT_OPERATIONS;
+     int threads     = argc >= 3 ? atoi(argv[2]) : TEST_DEFAULT_THREADS;
+     unsigned seed   = argc >= 4 ? atoi(argv[3]) : TEST_DEFAULT_SEED;
+     if( operations <= 0 || threads <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [operations] [threads] [seed]" << std::endl;
+          return 1;
+     }
+
+     unsigned char* zeroed = (unsigned char*)scalloc(50, 4);
+     check(zeroed && filled_with(zeroed, 200, 0), "scalloc(50, 4) is zeroed");
+     sfree(zeroed);
+     check(churn(operations, seed), "one thread: every block kept its contents");
+     check(scheck_heap() == 0, "scheck_heap after one thread");
+
+     std::vector<std::thread> workers;
+     std::vector<char> intact(threads, true);
+     for(int t = 0 ; t < threads ; ++t){
+          workers.emplace_back(threaded_churn, t + 1, operations / 2, (bool*)&intact[t]);
+     }
+     for(std::thread& worker : workers){
+          worker.join();
+     }
+     for(void* p : handoff){
+          sfree(p);
+     }
+     handoff.clear();
+     check(std::find(intact.begin(), intact.end(), false) == intact.end(), "threads: every block kept its contents");
+     check(scheck_heap() == 0, "scheck_heap after threads");
+
+     size_t start = arenas(), worst = 0;
+     for(int round = 0 ; round < TEST_RELEASE_ROUNDS ; ++round){
+          std::thread(release_round, round).join();
+          worst = std::max(worst, arenas());
+     }
+     printf("arenas before the release rounds %zu, most left after one %zu\n", start, worst);
+     check(worst <= std::max(start, (size_t)TEST_ARENAS_KEPT), "freeing every block gives the empty arenas back");
+     check(scheck_heap() == 0, "scheck_heap after the release rounds");
+     return failures;
+}
@@ -0,0 +1,193 @@
+
+// Checks the telemetry dump of malloc_3 (stelemetry_signal / stelemetry_dump): a program's own handler is
+// left alone, a signal raised while heap_lock is held dumps once the lock is released, signals in the
+// middle of multithreaded churn still give whole JSON objects, and a forked child can dump again.
+//   g++ -std=c++11 -O2 malloc_telemetry_test.cpp malloc_3.cpp -o telemetry_test -pthread
+//   g++ -std=c++11 -O2 -DMALLOC_TELEMETRY=1 malloc_telemetry_test.cpp malloc_3.cpp -o telemetry_test_latency -pthread
+//   ./telemetry_test [dump file] [operations per thread]
+// Exits with the number of failed checks. The JSON check only balances brackets outside strings, which
+// is enough to tell a whole dump from a cut or interleaved one. The dump files are removed again.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define TEST_DEFAULT_PATH         "/tmp/malloc_telemetry_test.json"
+#define TEST_DEFAULT_OPERATIONS   400000
+#define TEST_THREADS              4
+#define TEST_SIGNALS              8                // Raised by the first thread, spread over its run
+#define TEST_WAIT_MS              2000             // For the helper thread to write a dump
+#define TEST_LOCKED_MS            200
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+size_t scheck_heap();
+void  stelemetry_dump(int fd);
+int   stelemetry_signal(int signo, int fd, const char* path);
+extern pthread_mutex_t heap_lock;                 // Not API, held here to delay a dump
+//================= Allocator related end ==============
+
+//================== Test related start ================
+int failures = 0;
+
+void check(bool ok, const char* what){
+     printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+     failures += !ok;
+}
+
+bool wait_for(const char* path, int ms){
+     for(int waited = 0 ; waited < ms ; waited += 10){
+          if( access(path, F_OK) == 0 ){
+               return true;
+          }
+          usleep(10000);
+     }
+     return access(path, F_OK) == 0;
+}
+
+std::string read_file(const char* path){
+     std::string text;
+     FILE* file = fopen(path, "r");
+     if( !file ){
+          return text;
+     }
+     char buffer[4096];
+     size_t got;
+     while( (got = fread(buffer, 1, sizeof(buffer), file)) > 0 ){
+          text.append(buffer, got);
+     }
+     fclose(file);
+     return text;
+}
+
+bool one_json_object(const std::string& text){    // Starts with {, and the brackets close exactly at the end
+     if( text.empty() || text[0] != '{' ){
+          return false;
+     }
+     int depth = 0;
+     bool in_string = false;
+     for(size_t i = 0 ; i < text.size() ; ++i){
+          char c = text[i];
+          if( in_string ){
+               in_string = !(c == '"' && text[i - 1] != '\\');
+               continue;
+          }
+          if( c == '"' ){
+               in_string = true;
+          }
+          else if( c == '{' || c == '[' ){
+               depth++;
+          }
+          else if( c == '}' || c == ']' ){
+               if( --depth == 0 ){
+                    return text.find_first_not_of(" \n", i + 1) == std::string::npos;
+               }
+          }
+     }
+     return false;
+}
+
+void own_handler(int){
+}
+
+void churn(int id, long operations){
+     std::vector<void*> live;
+     uint32_t x = id + 1;
+     for(long i = 0 ; i < operations ; ++i){
+          x = x * 1103515245 + 12345;
+          size_t size = (x >> 8) % ((x & 7) ? 2000 : 300000) + 1;
+          if( live.size() < 2000 || (x & 1) ){
+               live.push_back(smalloc(size));
+          }
+          else{
+               size_t k = (x >> 3) % live.size();
+               sfree(live[k]);
+               live[k] = live.back();
+               live.pop_back();
+          }
+          if( id == 0 && i % (operations / TEST_SIGNALS + 1) == 0 ){
+               raise(SIGUSR1);
+          }
+     }
+     for(void* p : live){
+          sfree(p);
+     }
+}
+//=================== Test related end =================
+
+int main(int argc, char** argv){
+     const char* path = argc >= 2 ? argv[1] : TEST_DEFAULT_PATH;
+     long operations  = argc >= 3 ? atol(argv[2]) : TEST_DEFAULT_OPERATIONS;
+     if( operations <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [dump file] [operations per thread]" << std::endl;
+          return 1;
+     }
+     unlink(path);
+
+     signal(SIGUSR2, own_handler);
+     errno = 0;
+     check(stelemetry_signal(SIGUSR2, -1, path) == -1 && errno == EBUSY, "a program's own handler is left alone (EBUSY)");
+     check(stelemetry_signal(SIGUSR1, -1, path) == 0, "stelemetry_signal(SIGUSR1) installs");
+
+     pthread_mutex_lock(&heap_lock);
+     raise(SIGUSR1);
+     usleep(TEST_LOCKED_MS * 1000);
+     bool early = access(path, F_OK) == 0;
+     pthread_mutex_unlock(&heap_lock);
+     check(!early, "no dump while heap_lock is held");
+     check(wait_for(path, TEST_WAIT_MS), "the dump follows the unlock");
+     check(one_json_object(read_file(path)), "that dump is one JSON object");
+
+     std::vector<std::thread> workers;
+     for(int t = 0 ; t < TEST_THREADS ; ++t){
+          workers.emplace_back(churn, t, operations);
+     }
+     for(std::thread& worker : workers){
+          worker.join();
+     }
+     usleep(TEST_LOCKED_MS * 1000);               // Lets a dump still running finish before the file goes
+     unlink(path);
+     raise(SIGUSR1);
+     check(wait_for(path, TEST_WAIT_MS) && one_json_object(read_file(path)), "dump after signals mid-churn is one JSON object");
+
+     std::string direct_path = std::string(path) + ".direct";
+     FILE* direct = fopen(direct_path.c_str(), "w");
+     if( direct ){
+          stelemetry_dump(fileno(direct));
+          fclose(direct);
+     }
+     check(direct && one_json_object(read_file(direct_path.c_str())), "stelemetry_dump(fd) writes one JSON object");
+     unlink(direct_path.c_str());
+
+     std::string child_path = std::string(path) + ".child";
+     unlink(child_path.c_str());
+     fflush(stdout);
+     pid_t child = fork();
+     if( child == 0 ){                            // The helper thread stayed in the parent
+          if( stelemetry_signal(SIGUSR1, -1, child_path.c_str()) ){
+               _exit(2);
+          }
+          raise(SIGUSR1);
+          _exit(wait_for(child_path.c_str(), TEST_WAIT_MS) ? 0 : 1);
+     }
+     int status = 0;
+     waitpid(child, &status, 0);
+     check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "a forked child dumps after installing again");
+
+     unlink(path);
+     unlink(child_path.c_str());
+     check(scheck_heap() == 0, "scheck_heap at the end");
+     return failures;
+}
@@ -0,0 +1,92 @@
+
+// Chases pointers through a random cycle of heap nodes spread over far more memory than the TLB
+// covers with base pages, so most hops pay a page walk unless the arenas are backed by huge pages.
+//   g++ -std=c++11 -O2 malloc_tlb_bench.cpp malloc_3.cpp -o tlb_base -pthread
+//   g++ -std=c++11 -O2 -DHUGE_PAGE_ARENAS=1 malloc_tlb_bench.cpp malloc_3.cpp -o tlb_huge -pthread
+//   ./tlb_huge [nodes] [hops]
+// AnonHugePages comes from /proc/self/smaps_rollup and shows whether THP actually backed the heap.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_NODES       800000           // About 200 MiB of 208-byte nodes
+#define BENCH_DEFAULT_HOPS        50000000
+#define BENCH_SEED                1
+
+
+//================ Allocator related start =============
+void* smalloc(size_t size);
+void  sfree(void* p);
+//================= Allocator related end ==============
+
+//================== Bench related start ===============
+struct Node{
+     Node*               next;
+     char                pad[200];                // Puts a node in an order-1 block, past the slab sizes
+};
+
+uint64_t monotonic_ns(){
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+long anon_huge_kib(){                             // -1 if the kernel has no smaps_rollup
+     FILE* rollup = fopen("/proc/self/smaps_rollup", "r");
+     if( !rollup ){
+          return -1;
+     }
+     char line[256];
+     long kib = 0;
+     while( fgets(line, sizeof(line), rollup) ){
+          if( !strncmp(line, "AnonHugePages:", 14) ){
+               kib = atol(line + 14);
+          }
+     }
+     fclose(rollup);
+     return kib;
+}
+//=================== Bench related end ================
+
+int main(int argc, char** argv){
+     long nodes = argc >= 2 ? atol(argv[1]) : BENCH_DEFAULT_NODES;
+     long hops  = argc >= 3 ? atol(argv[2]) : BENCH_DEFAULT_HOPS;
+     if( nodes <= 0 || hops <= 0 ){
+          std::cerr << "usage: " << argv[0] << " [nodes] [hops]" << std::endl;
+          return 1;
+     }
+
+     std::vector<Node*> cycle(nodes);
+     for(long i = 0 ; i < nodes ; ++i){
+          if( !(cycle[i] = (Node*)smalloc(sizeof(Node))) ){
+               std::cerr << "smalloc(" << sizeof(Node) << ") failed" << std::endl;
+               return 1;
+          }
+          memset(cycle[i], 0, sizeof(Node));
+     }
+     std::mt19937_64 rng(BENCH_SEED);
+     std::shuffle(cycle.begin(), cycle.end(), rng);
+     for(long i = 0 ; i < nodes ; ++i){
+          cycle[i] -> next = cycle[(i + 1) % nodes];
+     }
+
+     Node* node = cycle[0];
+     uint64_t start = monotonic_ns();
+     for(long i = 0 ; i < hops ; ++i){            // Every load depends on the one before
+          node = node -> next;
+     }
+     double ns = (double)(monotonic_ns() - start) / hops;
+     printf("%ld nodes, %ld hops: %6.1f ns/hop, AnonHugePages %ld KiB\n", nodes, hops, ns, anon_huge_kib());
+     printf("(ended at %p)\n", (void*)node);      // Keeps the chase from being optimized away
+     for(Node* n : cycle){
+          sfree(n);
+     }
+     return 0;
+}
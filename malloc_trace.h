@@ -0,0 +1,35 @@
+#ifndef MALLOC_TRACE_H
+#define MALLOC_TRACE_H
+
+#include <stdint.h>
+
+// Binary allocation trace shared by malloc_record.cpp (writer) and malloc_replay.cpp (reader).
+// A trace is one TraceHeader followed by TraceRecord entries until end of file.
+
+#define TRACE_MAGIC           0x4352544d          // "MTRC" read as little endian
+#define TRACE_VERSION         1
+
+enum TraceOp : uint8_t{
+     TRACE_MALLOC  = 0,            // size = requested bytes, id = new object
+     TRACE_CALLOC  = 1,            // size = num*size
+     TRACE_REALLOC = 2,            // size = new size, id keeps naming the same object
+     TRACE_FREE    = 3             // size = 0
+};
+
+struct TraceHeader{
+     uint32_t magic;
+     uint32_t version;
+};
+
+struct __attribute__((packed)) TraceRecord{       // 20 bytes on disk
+     uint64_t timestamp_ns;        // Since the recorder started
+     uint32_t size;                // MAX_SIZE_MALLOC_REQ fits, larger requests are not recorded
+     uint32_t id;                  // Dense object ids starting at 0
+     uint16_t thread;              // Dense thread ids starting at 0
+     uint8_t  op;                  // TraceOp
+     uint8_t  reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 20, "TraceRecord must stay 20 bytes");
+
+#endif // MALLOC_TRACE_H